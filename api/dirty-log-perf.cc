@@ -5,6 +5,7 @@
 #include <boost/thread/thread.hpp>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sched.h>
 #include <sys/time.h>
 
 namespace {
@@ -12,6 +13,14 @@ namespace {
 const int page_size	= 4096;
 int64_t nr_total_pages	= 256 * 1024;
 int64_t nr_slot_pages	= 256 * 1024;
+bool manual_protect	= false;
+bool compare_ring	= false;
+unsigned ring_entries	= 65536;
+int nr_vcpus		= 0;
+int nr_passes		= 8;
+mem_backing::type backing = mem_backing::anon;
+int numa_node		= -1;
+std::vector<int> host_cpus;
 
 // Return the current time in nanoseconds.
 uint64_t time_ns()
@@ -36,36 +45,326 @@ void write_mem(void* slot_head, int64_t nr_to_write, int64_t nr_pages)
 
 using boost::ref;
 using std::tr1::bind;
+using namespace std::tr1::placeholders;
+
+// Accumulate the dirty ranges reported by mem_slot::for_each_dirty_range().
+struct harvester {
+    explicit harvester(mem_slot& slot) : slot(slot), pages(0), ranges(0) {}
+    void operator()(uint64_t gpa, uint64_t len) {
+        pages += len / page_size;
+        ++ranges;
+        if (manual_protect) {
+            slot.clear_dirty_log(gpa, len);
+        }
+    }
+    mem_slot& slot;
+    int64_t pages;
+    int64_t ranges;
+};
+
+// Collects dirty pages either from the slot bitmap or, once the VM has
+// dirty rings enabled, from the rings of all vCPUs.
+class dirty_tracker {
+public:
+    dirty_tracker(kvm::vm& vm, mem_slot& slot,
+                  std::vector<kvm::vcpu*>& vcpus)
+        : _vm(vm), _slot(slot), _vcpus(vcpus), _ring_ns(0)
+    {
+    }
+    bool ring() const { return _vm.dirty_ring_entries(); }
+    const char* name() const { return ring() ? "ring" : "bitmap"; }
+    // Returns the number of dirty pages collected.
+    int64_t harvest();
+    // Run vcpu until the guest is done.  When its ring fills up, either
+    // reap it (reap) or wait for a concurrent harvest().
+    void run(kvm::vcpu& vcpu, bool reap);
+    // Time spent reaping full rings inside run(); reset on read.
+    uint64_t take_ring_ns();
+private:
+    kvm::vm& _vm;
+    mem_slot& _slot;
+    std::vector<kvm::vcpu*>& _vcpus;
+    std::vector<kvm_dirty_gfn> _gfns;
+    uint64_t _ring_ns;
+};
+
+int64_t dirty_tracker::harvest()
+{
+    if (!ring()) {
+        _slot.update_dirty_log();
+        return _slot.for_each_dirty_range(harvester(_slot)).pages;
+    }
+
+    int64_t pages = 0;
+    for (size_t i = 0; i < _vcpus.size(); ++i) {
+        _gfns.clear();
+        pages += _vcpus[i]->reap_dirty_ring(_gfns);
+    }
+    _vm.reset_dirty_rings();
+    return pages;
+}
+
+void dirty_tracker::run(kvm::vcpu& vcpu, bool reap)
+{
+    std::vector<kvm_dirty_gfn> gfns;
+
+    for (;;) {
+        vcpu.run();
+        if (vcpu.shared()->exit_reason != KVM_EXIT_DIRTY_RING_FULL) {
+            return;
+        }
+        if (reap) {
+            // only this vCPU's ring, so that writers can do it in parallel
+            uint64_t start_ns = time_ns();
+            gfns.clear();
+            vcpu.reap_dirty_ring(gfns);
+            _vm.reset_dirty_rings();
+            __sync_fetch_and_add(&_ring_ns, time_ns() - start_ns);
+        } else {
+            // the concurrent harvester will make room
+            sched_yield();
+        }
+    }
+}
+
+uint64_t dirty_tracker::take_ring_ns()
+{
+    uint64_t ns = _ring_ns;
+    _ring_ns = 0;
+    return ns;
+}
 
 // Let the guest update nr_to_write pages selected from nr_pages pages.
-void do_guest_write(kvm::vcpu& vcpu, void* slot_head,
+void do_guest_write(dirty_tracker& dt, kvm::vcpu& vcpu, void* slot_head,
                     int64_t nr_to_write, int64_t nr_pages)
 {
     identity::vcpu guest_write_thread(vcpu, bind(write_mem, ref(slot_head),
                                                  nr_to_write, nr_pages));
-    vcpu.run();
+    dt.run(vcpu, true);
+}
+
+// Time full writes of the slot without dirty logging, right after
+// enabling it and once more after a harvest.  With huge page backing,
+// KVM has to split the huge mappings built by the unlogged pass, either
+// when logging is enabled (eager splitting) or in the first logged
+// write faults; comparing the two logged passes shows that cost.
+void check_split(dirty_tracker& dt, kvm::vcpu& vcpu, mem_slot& slot,
+                 void* slot_head)
+{
+    uint64_t t0 = time_ns();
+    do_guest_write(dt, vcpu, slot_head, nr_slot_pages, nr_slot_pages);
+    uint64_t t1 = time_ns();
+    slot.set_dirty_logging(true);
+    uint64_t t2 = time_ns();
+    do_guest_write(dt, vcpu, slot_head, nr_slot_pages, nr_slot_pages);
+    uint64_t t3 = time_ns();
+    dt.harvest();
+    if (manual_protect && !dt.ring()) {
+        slot.clear_dirty_log();
+    }
+    uint64_t t4 = time_ns();
+    do_guest_write(dt, vcpu, slot_head, nr_slot_pages, nr_slot_pages);
+    uint64_t t5 = time_ns();
+    dt.take_ring_ns();
+    slot.set_dirty_logging(false);
+
+    printf("%-6s: %s backing: write %10lld ns unlogged, enable %10lld ns, "
+           "write %10lld ns first logged, %10lld ns next\n",
+           dt.name(), mem_backing::type_name(backing), t1 - t0, t2 - t1,
+           t3 - t2, t5 - t4);
 }
 
-// Check how long it takes to update dirty log.
-void check_dirty_log(kvm::vcpu& vcpu, mem_slot& slot, void* slot_head)
+// Check how long it takes to collect the dirty pages.  In ring mode, a
+// ring that fills up while the guest writes is reaped on the spot and
+// that time is reported separately.
+void check_dirty_log(dirty_tracker& dt, kvm::vcpu& vcpu, mem_slot& slot,
+                     void* slot_head)
 {
     slot.set_dirty_logging(true);
-    slot.update_dirty_log();
+    dt.harvest();
+    if (manual_protect && !dt.ring()) {
+        slot.clear_dirty_log();
+    }
 
     for (int64_t i = 1; i <= nr_slot_pages; i *= 2) {
-        do_guest_write(vcpu, slot_head, i, nr_slot_pages);
+        do_guest_write(dt, vcpu, slot_head, i, nr_slot_pages);
+        uint64_t ring_ns = dt.take_ring_ns();
 
         uint64_t start_ns = time_ns();
-        slot.update_dirty_log();
+        int64_t pages = dt.harvest();
         uint64_t end_ns = time_ns();
 
-        printf("get dirty log: %10lld ns for %10lld dirty pages\n",
-               end_ns - start_ns, i);
+        printf("%-6s: harvest%s: %10lld ns (%10lld ns while running) "
+               "for %10lld dirty pages (%lld collected)\n",
+               dt.name(), manual_protect && !dt.ring() ? "+clear" : "",
+               end_ns - start_ns, ring_ns, i, pages);
+    }
+
+    slot.set_dirty_logging(false);
+}
+
+// Write every page of a vCPU's region, nr_passes times.
+void write_region(char* region, int64_t nr_pages)
+{
+    for (int pass = 0; pass < nr_passes; ++pass) {
+        char* var = region;
+        for (int64_t i = 0; i < nr_pages; ++i) {
+            ++(*var);
+            var += page_size;
+        }
+    }
+}
+
+struct writer_state {
+    char* region;
+    int64_t nr_pages;
+    uint64_t ns;
+};
+
+volatile int nr_writing;
+
+void writer_guest(writer_state* w, int i)
+{
+    write_region(w[i].region, w[i].nr_pages);
+}
+
+void writer_run(dirty_tracker& dt, writer_state* w, bool reap,
+                int i, kvm::vcpu& vcpu)
+{
+    uint64_t start_ns = time_ns();
+    dt.run(vcpu, reap);
+    w[i].ns = time_ns() - start_ns;
+    __sync_fetch_and_sub(&nr_writing, 1);
+}
+
+struct harvest_stats {
+    int64_t nr_harvests;
+    int64_t pages;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+// Collect (and with -p clear) the dirty pages back to back until every
+// writer is done.
+void harvester_thread(dirty_tracker& dt, harvest_stats& st)
+{
+    st = harvest_stats();
+    while (nr_writing) {
+        uint64_t start_ns = time_ns();
+        int64_t pages = dt.harvest();
+        uint64_t ns = time_ns() - start_ns;
+
+        ++st.nr_harvests;
+        st.pages += pages;
+        st.total_ns += ns;
+        st.max_ns = std::max(st.max_ns, ns);
+    }
+}
+
+// Run the writers on the first n vCPUs, with or without a concurrent
+// harvester, and return the slowest writer's time.
+uint64_t run_writers(dirty_tracker& dt, identity::vcpu_pool& pool, int n,
+                     void* slot_head, bool harvest, harvest_stats& st)
+{
+    std::vector<writer_state> w(n);
+    int64_t region_pages = nr_slot_pages / n;
+
+    nr_writing = n;
+    for (int i = 0; i < n; ++i) {
+        w[i].region = static_cast<char*>(slot_head)
+                      + i * region_pages * page_size;
+        w[i].nr_pages = region_pages;
+    }
+    pool.start(std::tr1::bind(writer_guest, &w[0], _1), n,
+               std::tr1::bind(writer_run, ref(dt), &w[0], !harvest, _1, _2));
+    if (harvest) {
+        harvester_thread(dt, st);
+    }
+    pool.wait();
+
+    uint64_t max_ns = 0;
+    for (int i = 0; i < n; ++i) {
+        max_ns = std::max(max_ns, w[i].ns);
+    }
+    return max_ns;
+}
+
+// For 1, 2, 4, ... nr_vcpus vCPUs, compare the time the guest takes to
+// dirty the slot with and without a harvester running concurrently.
+void check_concurrent(dirty_tracker& dt, identity::vcpu_pool& pool,
+                      mem_slot& slot, void* slot_head)
+{
+    slot.set_dirty_logging(true);
+
+    for (int n = 1; ; n = std::min(n * 2, nr_vcpus)) {
+        harvest_stats st;
+
+        dt.harvest();
+        if (manual_protect && !dt.ring()) {
+            slot.clear_dirty_log();
+        }
+        // baseline: no harvester, so with the bitmap pages stay writable
+        // after the first fault; rings are reaped by their own vCPU as
+        // they fill up
+        uint64_t base_ns = run_writers(dt, pool, n, slot_head, false, st);
+        dt.take_ring_ns();
+        uint64_t ns = run_writers(dt, pool, n, slot_head, true, st);
+
+        printf("%-6s: %3d vcpus: guest %10lld ns (baseline %10lld ns, "
+               "slowdown %.2f), %6lld harvests, latency avg %9lld ns "
+               "max %9lld ns, %10lld pages/sec\n",
+               dt.name(), n, ns, base_ns, (double)ns / base_ns,
+               st.nr_harvests,
+               st.nr_harvests ? st.total_ns / st.nr_harvests : 0,
+               st.max_ns,
+               ns ? st.pages * 1000000000LL / (int64_t)ns : 0);
+        if (n == nr_vcpus) {
+            break;
+        }
     }
 
     slot.set_dirty_logging(false);
 }
 
+// Build a VM around the guest memory and run the workloads on it, with
+// dirty tracking through the bitmap or, if ring is set, the dirty rings.
+void run_benchmark(kvm::system& sys, void* mem_head, bool ring)
+{
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    if (ring) {
+        vm.enable_dirty_ring(ring_entries);
+    } else if (manual_protect && !memmap.enable_manual_dirty_protect()) {
+        printf("dirty-log-perf: manual dirty log protect not supported\n");
+        exit(1);
+    }
+
+    int64_t mem_size = nr_total_pages * page_size;
+    uint64_t mem_addr = reinterpret_cast<uintptr_t>(mem_head);
+
+    identity::hole hole(mem_head, mem_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    identity::vcpu_pool pool(vm, std::max(nr_vcpus, 1), host_cpus);
+    kvm::vcpu& vcpu = pool[0];
+
+    uint64_t slot_size = nr_slot_pages * page_size;
+    uint64_t next_size = mem_size - slot_size;
+    uint64_t next_addr = mem_addr + slot_size;
+    mem_slot slot(memmap, mem_addr, slot_size, mem_head);
+    mem_slot other_slot(memmap, next_addr, next_size, (void *)next_addr);
+    dirty_tracker dt(vm, slot, pool.vcpus());
+
+    // pre-allocate shadow pages
+    do_guest_write(dt, vcpu, mem_head, nr_total_pages, nr_total_pages);
+    check_split(dt, vcpu, slot, mem_head);
+    check_dirty_log(dt, vcpu, slot, mem_head);
+
+    if (nr_vcpus) {
+        check_concurrent(dt, pool, slot, mem_head);
+    }
+}
+
 }
 
 void parse_options(int ac, char **av)
@@ -73,8 +372,49 @@ void parse_options(int ac, char **av)
     int opt;
     char *endptr;
 
-    while ((opt = getopt(ac, av, "n:m:")) != -1) {
+    while ((opt = getopt(ac, av, "b:c:n:m:N:pr::v:")) != -1) {
         switch (opt) {
+        case 'r':
+            compare_ring = true;
+            if (optarg) {
+                ring_entries = atoi(optarg);
+            }
+            break;
+        case 'v':
+            nr_vcpus = atoi(optarg);
+            if (nr_vcpus <= 0) {
+                printf("dirty-log-perf: Invalid number: -v %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (!mem_backing::parse_type(optarg, backing)) {
+                printf("dirty-log-perf: Invalid backing: -b %s "
+                       "(4k, thp, 2m or 1g)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            numa_node = atoi(optarg);
+            break;
+        case 'c':
+            // host cpu for each vCPU, in order: -c 2,3,4,5
+            for (char* p = optarg; *p; ) {
+                errno = 0;
+                long cpu = strtol(p, &endptr, 10);
+                if (errno || endptr == p || cpu < 0
+                    || (*endptr && *endptr != ',')) {
+                    printf("dirty-log-perf: Invalid cpu list: -c %s\n",
+                           optarg);
+                    exit(1);
+                }
+                host_cpus.push_back(cpu);
+                p = *endptr ? endptr + 1 : endptr;
+            }
+            break;
+        case 'p':
+            manual_protect = true;
+            break;
         case 'n':
             errno = 0;
             nr_slot_pages = strtol(optarg, &endptr, 10);
@@ -115,32 +455,37 @@ void parse_options(int ac, char **av)
 int test_main(int ac, char **av)
 {
     kvm::system sys;
-    kvm::vm vm(sys);
-    mem_map memmap(vm);
 
     parse_options(ac, av);
 
-    void* mem_head;
-    int64_t mem_size = nr_total_pages * page_size;
-    if (posix_memalign(&mem_head, page_size, mem_size)) {
-        printf("dirty-log-perf: Could not allocate guest memory.\n");
-        exit(1);
+    if (compare_ring) {
+        // the ring size must be a power of two, capped by the kernel
+        unsigned max_entries = sys.get_extension_int(KVM_CAP_DIRTY_LOG_RING)
+                               / sizeof(kvm_dirty_gfn);
+        if (!max_entries) {
+            printf("dirty-log-perf: dirty ring not supported\n");
+            exit(1);
+        }
+        if (ring_entries & (ring_entries - 1)) {
+            printf("dirty-log-perf: Invalid ring size: %u\n", ring_entries);
+            exit(1);
+        }
+        ring_entries = std::min(ring_entries, max_entries);
+        printf("dirty-log-perf: %u dirty ring entries per vcpu\n",
+               ring_entries);
     }
-    uint64_t mem_addr = reinterpret_cast<uintptr_t>(mem_head);
 
-    identity::hole hole(mem_head, mem_size);
-    identity::vm ident_vm(vm, memmap, hole);
-    kvm::vcpu vcpu(vm, 0);
-
-    uint64_t slot_size = nr_slot_pages * page_size;
-    uint64_t next_size = mem_size - slot_size;
-    uint64_t next_addr = mem_addr + slot_size;
-    mem_slot slot(memmap, mem_addr, slot_size, mem_head);
-    mem_slot other_slot(memmap, next_addr, next_size, (void *)next_addr);
+    mem_backing mem(nr_total_pages * page_size, backing, numa_node);
+    printf("dirty-log-perf: %s backing", mem.name());
+    if (numa_node >= 0) {
+        printf(" on node %d", numa_node);
+    }
+    printf("\n");
 
-    // pre-allocate shadow pages
-    do_guest_write(vcpu, mem_head, nr_total_pages, nr_total_pages);
-    check_dirty_log(vcpu, slot, mem_head);
+    run_benchmark(sys, mem.addr(), false);
+    if (compare_ring) {
+        run_benchmark(sys, mem.addr(), true);
+    }
     return 0;
 }
 
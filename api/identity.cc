@@ -1,8 +1,13 @@
 
 #include "identity.hh"
 #include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 namespace identity {
 
@@ -80,7 +85,8 @@ void vcpu::setup_sregs()
     asm ("mov %%gs:0, %0" : "=r"(gsbase));
     sregs.gs.base = gsbase;
 
-    sregs.tr.base = reinterpret_cast<uintptr_t>(&*_stack.begin());
+    sregs.tr.base = reinterpret_cast<uintptr_t>(&*_tss.begin());
+    sregs.tr.limit = tss_size - 1;
     sregs.tr.type = 11;
     sregs.tr.s = 0;
     sregs.tr.present = 1;
@@ -116,9 +122,97 @@ void vcpu::setup_regs()
 vcpu::vcpu(kvm::vcpu& vcpu, std::tr1::function<void ()> guest_func,
            unsigned long stack_size)
     : _vcpu(vcpu), _guest_func(guest_func), _stack(stack_size)
+    , _tss(tss_size)
 {
     setup_sregs();
     setup_regs();
 }
 
+struct vcpu_pool::start_state {
+    start_state(int nr, guest_fn guest, run_fn runner)
+	: barrier(nr + 1), guest(guest), runner(runner) {}
+    boost::barrier barrier;
+    boost::thread_group threads;
+    guest_fn guest;
+    run_fn runner;
+};
+
+vcpu_pool::vcpu_pool(kvm::vm& vm, int nr_vcpus,
+		     const std::vector<int>& host_cpus,
+		     unsigned long stack_size)
+    : _host_cpus(host_cpus), _stack_size(stack_size)
+{
+    try {
+	for (int i = 0; i < nr_vcpus; ++i) {
+	    _vcpus.push_back(new kvm::vcpu(vm, i));
+	}
+    } catch (...) {
+	for (size_t i = 0; i < _vcpus.size(); ++i) {
+	    delete _vcpus[i];
+	}
+	throw;
+    }
+}
+
+vcpu_pool::~vcpu_pool()
+{
+    if (_start) {
+	_start->threads.join_all();
+    }
+    for (size_t i = 0; i < _vcpus.size(); ++i) {
+	delete _vcpus[i];
+    }
+}
+
+void vcpu_pool::thread_main(vcpu_pool* pool, int i, start_state* st)
+{
+    if (i < (int)pool->_host_cpus.size() && pool->_host_cpus[i] >= 0) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(pool->_host_cpus[i], &set);
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (r) {
+	    printf("vcpu %d: cannot pin to host cpu %d: %s\n", i,
+		   pool->_host_cpus[i], strerror(r));
+	}
+    }
+
+    kvm::vcpu& kvcpu = *pool->_vcpus[i];
+    vcpu guest(kvcpu, std::tr1::bind(st->guest, i), pool->_stack_size);
+    st->barrier.wait();
+    if (st->runner) {
+	st->runner(i, kvcpu);
+    } else {
+	kvcpu.run();
+    }
+}
+
+void vcpu_pool::start(guest_fn guest, int nr, run_fn runner)
+{
+    wait();
+    if (nr < 0 || nr > size()) {
+	nr = size();
+    }
+    _start.reset(new start_state(nr, guest, runner));
+    for (int i = 0; i < nr; ++i) {
+	_start->threads.create_thread(std::tr1::bind(thread_main, this, i,
+						     _start.get()));
+    }
+    _start->barrier.wait();
+}
+
+void vcpu_pool::wait()
+{
+    if (_start) {
+	_start->threads.join_all();
+	_start.reset();
+    }
+}
+
+void vcpu_pool::run(guest_fn guest, int nr, run_fn runner)
+{
+    start(guest, nr, runner);
+    wait();
+}
+
 }
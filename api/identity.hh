@@ -26,6 +26,9 @@ private:
     std::vector<mem_slot_ptr> _slots;
 };
 
+// Prepares vcpu to run guest_func on its own stack and TSS.  The guest
+// inherits the TLS base (%gs) of the constructing thread, so construct it
+// on the thread that will run the vCPU.
 class vcpu {
 public:
     vcpu(kvm::vcpu& vcpu, std::tr1::function<void ()> guest_func,
@@ -35,9 +38,44 @@ private:
     void setup_regs();
     void setup_sregs();
 private:
+    static const unsigned tss_size = 104;
     kvm::vcpu& _vcpu;
     std::tr1::function<void ()> _guest_func;
     std::vector<char> _stack;
+    std::vector<char> _tss;
+};
+
+// A set of vCPUs, each run from its own host thread, optionally pinned to
+// a host CPU (host_cpus[i] for vCPU i, -1 or missing for no pinning).
+class vcpu_pool {
+public:
+    // guest(i) runs in the guest on vCPU i.
+    typedef std::tr1::function<void (int)> guest_fn;
+    // runner(i, vcpu) enters the guest from the host; by default it is
+    // vcpu.run().
+    typedef std::tr1::function<void (int, kvm::vcpu&)> run_fn;
+
+    vcpu_pool(kvm::vm& vm, int nr_vcpus,
+	      const std::vector<int>& host_cpus = std::vector<int>(),
+	      unsigned long stack_size = 256 * 1024);
+    ~vcpu_pool();
+    int size() const { return _vcpus.size(); }
+    kvm::vcpu& operator[](int i) { return *_vcpus[i]; }
+    std::vector<kvm::vcpu*>& vcpus() { return _vcpus; }
+    // Run guest on the first nr vCPUs (all if nr < 0).  start() returns
+    // when every thread is set up, at the moment they all enter the
+    // guest; wait() joins them.  run() does both.
+    void start(guest_fn guest, int nr = -1, run_fn runner = run_fn());
+    void wait();
+    void run(guest_fn guest, int nr = -1, run_fn runner = run_fn());
+private:
+    struct start_state;
+    static void thread_main(vcpu_pool* pool, int i, start_state* st);
+private:
+    std::vector<kvm::vcpu*> _vcpus;
+    std::vector<int> _host_cpus;
+    unsigned long _stack_size;
+    std::tr1::shared_ptr<start_state> _start;
 };
 
 }
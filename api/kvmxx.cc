@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <memory>
 #include <algorithm>
+#include <string.h>
+#include <time.h>
 
 namespace kvm {
 
@@ -42,7 +44,9 @@ long fd::ioctl(unsigned nr, long arg)
 vcpu::vcpu(vm& vm, int id)
     : _vm(vm), _fd(vm._fd.ioctl(KVM_CREATE_VCPU, id)), _shared(NULL)
     , _mmap_size(_vm._system._fd.ioctl(KVM_GET_VCPU_MMAP_SIZE, 0))
-
+    , _coalesced_ring(NULL)
+    , _dirty_ring(NULL), _dirty_ring_entries(vm._dirty_ring_entries)
+    , _dirty_ring_fetch(0)
 {
     kvm_run *shared = static_cast<kvm_run*>(::mmap(NULL, _mmap_size,
 						   PROT_READ | PROT_WRITE,
@@ -52,18 +56,150 @@ vcpu::vcpu(vm& vm, int id)
 	throw errno_exception(errno);
     }
     _shared = shared;
+    reset_stats();
+
+    int coalesced_page = _vm._system.get_extension_int(KVM_CAP_COALESCED_MMIO);
+    if (coalesced_page) {
+	_coalesced_ring = reinterpret_cast<kvm_coalesced_mmio_ring*>(
+	    reinterpret_cast<char*>(shared) + coalesced_page * getpagesize());
+    }
+
+    if (_dirty_ring_entries) {
+	void *ring = ::mmap(NULL, _dirty_ring_entries * sizeof(kvm_dirty_gfn),
+			    PROT_READ | PROT_WRITE, MAP_SHARED, _fd.get(),
+			    KVM_DIRTY_LOG_PAGE_OFFSET * getpagesize());
+	if (ring == MAP_FAILED) {
+	    int err = errno;
+	    munmap(_shared, _mmap_size);
+	    throw errno_exception(err);
+	}
+	_dirty_ring = static_cast<kvm_dirty_gfn*>(ring);
+    }
 }
 
 vcpu::~vcpu()
 {
+    if (_dirty_ring) {
+	munmap(_dirty_ring, _dirty_ring_entries * sizeof(kvm_dirty_gfn));
+    }
     munmap(_shared, _mmap_size);
 }
 
+unsigned vcpu::reap_dirty_ring(std::vector<kvm_dirty_gfn>& gfns)
+{
+    unsigned n = 0;
+
+    if (!_dirty_ring) {
+	return 0;
+    }
+    for (;;) {
+	kvm_dirty_gfn *e = &_dirty_ring[_dirty_ring_fetch % _dirty_ring_entries];
+	if (!(__atomic_load_n(&e->flags, __ATOMIC_ACQUIRE)
+	      & KVM_DIRTY_GFN_F_DIRTY)) {
+	    break;
+	}
+	gfns.push_back(*e);
+	__atomic_store_n(&e->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+	++_dirty_ring_fetch;
+	++n;
+    }
+    return n;
+}
+
 void vcpu::run()
 {
     _fd.ioctl(KVM_RUN, 0);
 }
 
+static uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+void vcpu::reset_stats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void vcpu::drain_coalesced_mmio(const exit_table& table, void* opaque)
+{
+    kvm_coalesced_mmio_ring *ring = _coalesced_ring;
+    unsigned max = (getpagesize() - sizeof(*ring))
+		   / sizeof(kvm_coalesced_mmio);
+
+    if (__atomic_load_n(&ring->first, __ATOMIC_RELAXED)
+	== __atomic_load_n(&ring->last, __ATOMIC_RELAXED)) {
+	return;
+    }
+
+    // The ring belongs to the VM, so another vCPU may be draining it too.
+    boost::mutex::scoped_lock lock(_vm._coalesced_lock);
+    while (ring->first != ring->last) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (table.coalesced_mmio) {
+	    table.coalesced_mmio(*this, ring->coalesced_mmio[ring->first],
+				 opaque);
+	}
+	++_stats.coalesced_mmio;
+	__atomic_store_n(&ring->first, (ring->first + 1) % max,
+			 __ATOMIC_RELEASE);
+    }
+}
+
+uint32_t vcpu::run_loop(const exit_table& table, void* opaque)
+{
+    exit_handler_fn dispatch[exit_stats::nr_reasons] = {};
+
+    for (unsigned i = 0; i < table.nr_handlers; ++i) {
+	if (table.handlers[i].reason < exit_stats::nr_reasons) {
+	    dispatch[table.handlers[i].reason] = table.handlers[i].fn;
+	}
+    }
+
+    for (;;) {
+	uint64_t start_ns = time_ns();
+	run();
+	uint64_t exit_ns = time_ns();
+
+	if (_coalesced_ring) {
+	    drain_coalesced_mmio(table, opaque);
+	}
+
+	uint32_t reason = _shared->exit_reason;
+	unsigned slot = std::min(reason, exit_stats::nr_reasons - 1);
+	exit_handler_fn fn = reason < exit_stats::nr_reasons
+			     ? dispatch[reason] : NULL;
+	bool more = fn && fn(*this, opaque);
+
+	++_stats.count[slot];
+	_stats.run_ns[slot] += exit_ns - start_ns;
+	_stats.handle_ns[slot] += time_ns() - exit_ns;
+	if (!more) {
+	    return reason;
+	}
+    }
+}
+
+const char* exit_reason_name(uint32_t reason)
+{
+    static const char* names[] = {
+	"unknown", "exception", "io", "hypercall", "debug", "hlt", "mmio",
+	"irq_window_open", "shutdown", "fail_entry", "intr", "set_tpr",
+	"tpr_access", "s390_sieic", "s390_reset", "dcr", "nmi",
+	"internal_error", "osi", "papr_hcall", "s390_ucontrol", "watchdog",
+	"s390_tsch", "epr", "system_event", "s390_stsi", "ioapic_eoi",
+	"hyperv", "arm_nisv", "x86_rdmsr", "x86_wrmsr", "dirty_ring_full",
+    };
+
+    if (reason < sizeof(names) / sizeof(names[0])) {
+	return names[reason];
+    }
+    return "other";
+}
+
 kvm_regs vcpu::regs()
 {
     kvm_regs regs;
@@ -88,44 +224,89 @@ void vcpu::set_sregs(const kvm_sregs& sregs)
     _fd.ioctlp(KVM_SET_SREGS, const_cast<kvm_sregs*>(&sregs));
 }
 
-class vcpu::kvm_msrs_ptr {
-public:
-    explicit kvm_msrs_ptr(size_t nmsrs);
-    ~kvm_msrs_ptr() { ::free(_kvm_msrs); }
-    kvm_msrs* operator->() { return _kvm_msrs; }
-    kvm_msrs* get() { return _kvm_msrs; }
-private:
-    kvm_msrs* _kvm_msrs;
-};
+msr_batch::msr_batch(unsigned capacity)
+    : _msrs(0), _capacity(0)
+{
+    reserve(capacity);
+}
+
+msr_batch::~msr_batch()
+{
+    ::free(_msrs);
+}
 
-vcpu::kvm_msrs_ptr::kvm_msrs_ptr(size_t nmsrs)
-    : _kvm_msrs(0)
+void msr_batch::reserve(unsigned capacity)
 {
-    size_t size = sizeof(kvm_msrs) + sizeof(kvm_msr_entry) * nmsrs;
-    _kvm_msrs = static_cast<kvm_msrs*>(::malloc(size));
-    if (!_kvm_msrs) {
+    if (_msrs && capacity <= _capacity) {
+	return;
+    }
+    size_t size = sizeof(kvm_msrs) + sizeof(kvm_msr_entry) * capacity;
+    kvm_msrs* msrs = static_cast<kvm_msrs*>(::realloc(_msrs, size));
+    if (!msrs) {
 	throw std::bad_alloc();
     }
+    if (!_msrs) {
+	msrs->nmsrs = 0;
+	msrs->pad = 0;
+    }
+    _msrs = msrs;
+    _capacity = capacity;
 }
 
-std::vector<kvm_msr_entry> vcpu::msrs(std::vector<uint32_t> indices)
+void msr_batch::add(uint32_t index, uint64_t data)
+{
+    if (_msrs->nmsrs == _capacity) {
+	reserve(std::max(2 * _capacity, 16U));
+    }
+    kvm_msr_entry& e = _msrs->entries[_msrs->nmsrs++];
+    e.index = index;
+    e.reserved = 0;
+    e.data = data;
+}
+
+void msr_batch::assign(const std::vector<uint32_t>& indices)
 {
-    kvm_msrs_ptr msrs(indices.size());
-    msrs->nmsrs = indices.size();
-    for (unsigned i = 0; i < msrs->nmsrs; ++i) {
-	msrs->entries[i].index = indices[i];
+    reserve(indices.size());
+    clear();
+    for (unsigned i = 0; i < indices.size(); ++i) {
+	add(indices[i]);
     }
-    _fd.ioctlp(KVM_GET_MSRS, msrs.get());
-    return std::vector<kvm_msr_entry>(msrs->entries,
-				      msrs->entries + msrs->nmsrs);
+}
+
+std::vector<kvm_msr_entry> vcpu::msrs(std::vector<uint32_t> indices)
+{
+    _msr_scratch.assign(indices);
+    get_msrs(_msr_scratch);
+    return std::vector<kvm_msr_entry>(_msr_scratch.begin(),
+				      _msr_scratch.end());
 }
 
 void vcpu::set_msrs(const std::vector<kvm_msr_entry>& msrs)
 {
-    kvm_msrs_ptr _msrs(msrs.size());
-    _msrs->nmsrs = msrs.size();
-    std::copy(msrs.begin(), msrs.end(), _msrs->entries);
-    _fd.ioctlp(KVM_SET_MSRS, _msrs.get());
+    _msr_scratch.reserve(msrs.size());
+    _msr_scratch.clear();
+    for (unsigned i = 0; i < msrs.size(); ++i) {
+	_msr_scratch.add(msrs[i].index, msrs[i].data);
+    }
+    set_msrs(_msr_scratch);
+}
+
+unsigned vcpu::get_msrs(msr_batch& batch)
+{
+    return _fd.ioctlp(KVM_GET_MSRS, batch.get());
+}
+
+unsigned vcpu::set_msrs(msr_batch& batch)
+{
+    return _fd.ioctlp(KVM_SET_MSRS, batch.get());
+}
+
+unsigned vcpu::get_all_msrs(msr_batch& batch)
+{
+    if (!batch.size()) {
+	batch.assign(_vm._system.msr_index_list());
+    }
+    return get_msrs(batch);
 }
 
 void vcpu::set_debug(uint64_t dr[8], bool enabled, bool singlestep)
@@ -147,6 +328,7 @@ void vcpu::set_debug(uint64_t dr[8], bool enabled, bool singlestep)
 
 vm::vm(system& system)
     : _system(system), _fd(system._fd.ioctl(KVM_CREATE_VM, 0))
+    , _dirty_ring_entries(0)
 {
 }
 
@@ -171,6 +353,80 @@ void vm::get_dirty_log(int slot, void *log)
     _fd.ioctlp(KVM_GET_DIRTY_LOG, &kdl);
 }
 
+void vm::clear_dirty_log(int slot, void *log, uint64_t first_page,
+                         uint32_t num_pages)
+{
+    struct kvm_clear_dirty_log kcdl = {};
+    kcdl.slot = slot;
+    kcdl.first_page = first_page;
+    kcdl.num_pages = num_pages;
+    kcdl.dirty_bitmap = log;
+    _fd.ioctlp(KVM_CLEAR_DIRTY_LOG, &kcdl);
+}
+
+void vm::enable_cap(uint32_t cap, uint64_t arg)
+{
+    struct kvm_enable_cap kec = {};
+    kec.cap = cap;
+    kec.args[0] = arg;
+    _fd.ioctlp(KVM_ENABLE_CAP, &kec);
+}
+
+void vm::enable_dirty_ring(unsigned entries)
+{
+    enable_cap(KVM_CAP_DIRTY_LOG_RING, entries * sizeof(kvm_dirty_gfn));
+    _dirty_ring_entries = entries;
+}
+
+int vm::reset_dirty_rings()
+{
+    return _fd.ioctl(KVM_RESET_DIRTY_RINGS, 0);
+}
+
+void vm::register_coalesced_mmio(uint64_t addr, uint32_t size, bool pio)
+{
+    kvm_coalesced_mmio_zone zone = {};
+    zone.addr = addr;
+    zone.size = size;
+    zone.pio = pio;
+    _fd.ioctlp(KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+void vm::unregister_coalesced_mmio(uint64_t addr, uint32_t size, bool pio)
+{
+    kvm_coalesced_mmio_zone zone = {};
+    zone.addr = addr;
+    zone.size = size;
+    zone.pio = pio;
+    _fd.ioctlp(KVM_UNREGISTER_COALESCED_MMIO, &zone);
+}
+
+static void ioeventfd(fd& vmfd, int efd, uint64_t addr, uint32_t len,
+		      bool pio, bool deassign)
+{
+    kvm_ioeventfd ioe = {};
+    ioe.addr = addr;
+    ioe.len = len;
+    ioe.fd = efd;
+    if (pio) {
+	ioe.flags |= KVM_IOEVENTFD_FLAG_PIO;
+    }
+    if (deassign) {
+	ioe.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
+    }
+    vmfd.ioctlp(KVM_IOEVENTFD, &ioe);
+}
+
+void vm::add_ioeventfd(int efd, uint64_t addr, uint32_t len, bool pio)
+{
+    ioeventfd(_fd, efd, addr, len, pio, false);
+}
+
+void vm::remove_ioeventfd(int efd, uint64_t addr, uint32_t len, bool pio)
+{
+    ioeventfd(_fd, efd, addr, len, pio, true);
+}
+
 void vm::set_tss_addr(uint32_t addr)
 {
     _fd.ioctl(KVM_SET_TSS_ADDR, addr);
@@ -191,4 +447,24 @@ int system::get_extension_int(int extension)
     return _fd.ioctl(KVM_CHECK_EXTENSION, extension);
 }
 
+const std::vector<uint32_t>& system::msr_index_list()
+{
+    if (!_msr_index_list.empty()) {
+	return _msr_index_list;
+    }
+
+    kvm_msr_list probe = { 0 };
+    if (::ioctl(_fd.get(), KVM_GET_MSR_INDEX_LIST, &probe) == -1
+	&& errno != E2BIG) {
+	throw errno_exception(errno);
+    }
+
+    std::vector<uint32_t> buf(1 + probe.nmsrs);
+    kvm_msr_list* list = reinterpret_cast<kvm_msr_list*>(&buf[0]);
+    list->nmsrs = probe.nmsrs;
+    _fd.ioctlp(KVM_GET_MSR_INDEX_LIST, list);
+    _msr_index_list.assign(list->indices, list->indices + list->nmsrs);
+    return _msr_index_list;
+}
+
 };
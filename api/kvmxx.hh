@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <linux/kvm.h>
 #include <stdint.h>
+#include <boost/thread/mutex.hpp>
 
 namespace kvm {
 
@@ -15,6 +16,7 @@ class system;
 class vm;
 class vcpu;
 class fd;
+class msr_batch;
 
 class fd {
 public:
@@ -31,26 +33,108 @@ private:
     int _fd;
 };
 
+// A kvm_msrs buffer that can be refilled and passed to KVM_GET_MSRS and
+// KVM_SET_MSRS again and again; memory is only allocated when it grows.
+class msr_batch {
+public:
+    explicit msr_batch(unsigned capacity = 0);
+    ~msr_batch();
+    void reserve(unsigned capacity);
+    void clear() { _msrs->nmsrs = 0; }
+    void add(uint32_t index, uint64_t data = 0);
+    void assign(const std::vector<uint32_t>& indices);
+    unsigned size() const { return _msrs->nmsrs; }
+    kvm_msr_entry& operator[](unsigned i) { return _msrs->entries[i]; }
+    const kvm_msr_entry& operator[](unsigned i) const {
+	return _msrs->entries[i];
+    }
+    kvm_msr_entry* begin() { return _msrs->entries; }
+    kvm_msr_entry* end() { return _msrs->entries + _msrs->nmsrs; }
+    kvm_msrs* get() { return _msrs; }
+private:
+    // not copyable
+    msr_batch(const msr_batch&);
+    msr_batch& operator=(const msr_batch&);
+private:
+    kvm_msrs* _msrs;
+    unsigned _capacity;
+};
+
+// Per exit reason counts and times, as collected by vcpu::run_loop().
+// run_ns is spent inside KVM_RUN, handle_ns in the userspace handler.
+struct exit_stats {
+    static const unsigned nr_reasons = 64;
+    uint64_t count[nr_reasons];
+    uint64_t run_ns[nr_reasons];
+    uint64_t handle_ns[nr_reasons];
+    uint64_t coalesced_mmio;
+};
+
+const char* exit_reason_name(uint32_t reason);
+
+// A handler returns true to re-enter the guest, false to leave run_loop().
+typedef bool (*exit_handler_fn)(vcpu& vcpu, void* opaque);
+typedef void (*coalesced_mmio_fn)(vcpu& vcpu,
+                                  const kvm_coalesced_mmio& mmio,
+                                  void* opaque);
+
+struct exit_handler {
+    uint32_t reason;
+    exit_handler_fn fn;
+};
+
+// A constant table of handlers, typically a static array built at compile
+// time, plus the callback for writes batched in the coalesced MMIO ring.
+// The ring is per VM; the callback runs under a per-VM lock, so it is
+// never called by two vCPUs of the same VM at once.
+struct exit_table {
+    const exit_handler* handlers;
+    unsigned nr_handlers;
+    coalesced_mmio_fn coalesced_mmio;
+};
+
 class vcpu {
 public:
     vcpu(vm& vm, int fd);
     ~vcpu();
     void run();
-    kvm_run *shared();
+    // Run the guest, draining the coalesced MMIO ring and dispatching
+    // every exit to its handler, until a handler returns false or an exit
+    // without a handler occurs; returns the last exit reason.
+    uint32_t run_loop(const exit_table& table, void* opaque = NULL);
+    const exit_stats& stats() const { return _stats; }
+    void reset_stats();
+    kvm_run *shared() { return _shared; }
     kvm_regs regs();
     void set_regs(const kvm_regs& regs);
     kvm_sregs sregs();
     void set_sregs(const kvm_sregs& sregs);
     std::vector<kvm_msr_entry> msrs(std::vector<uint32_t> indices);
     void set_msrs(const std::vector<kvm_msr_entry>& msrs);
+    // Read or write the MSRs in batch; return how many were processed.
+    unsigned get_msrs(msr_batch& batch);
+    unsigned set_msrs(msr_batch& batch);
+    // Read every MSR in system::msr_index_list() into batch, filling in
+    // the indices first if batch is empty.
+    unsigned get_all_msrs(msr_batch& batch);
     void set_debug(uint64_t dr[8], bool enabled, bool singlestep);
+    // Append the entries harvested from this vCPU's dirty ring to gfns
+    // and mark them for reset; returns their number.  Entries are only
+    // recycled after vm::reset_dirty_rings().
+    unsigned reap_dirty_ring(std::vector<kvm_dirty_gfn>& gfns);
 private:
-    class kvm_msrs_ptr;
+    void drain_coalesced_mmio(const exit_table& table, void* opaque);
 private:
     vm& _vm;
     fd _fd;
     kvm_run *_shared;
     unsigned _mmap_size;
+    kvm_coalesced_mmio_ring *_coalesced_ring;
+    exit_stats _stats;
+    kvm_dirty_gfn *_dirty_ring;
+    unsigned _dirty_ring_entries;
+    unsigned _dirty_ring_fetch;
+    msr_batch _msr_scratch;
     friend class vm;
 };
 
@@ -60,11 +144,37 @@ public:
     void set_memory_region(int slot, void *addr, uint64_t gpa, size_t len,
                            uint32_t flags = 0);
     void get_dirty_log(int slot, void *log);
+    void clear_dirty_log(int slot, void *log, uint64_t first_page,
+                         uint32_t num_pages);
+    void enable_cap(uint32_t cap, uint64_t arg = 0);
+    // Switch dirty tracking from the per-slot bitmap to per-vCPU rings of
+    // the given number of entries; must be called before creating vCPUs.
+    void enable_dirty_ring(unsigned entries);
+    unsigned dirty_ring_entries() const { return _dirty_ring_entries; }
+    int reset_dirty_rings();
+    // Writes to [addr, addr + size) are batched in the vCPUs' coalesced
+    // MMIO (or PIO) rings instead of exiting to userspace one by one.
+    void register_coalesced_mmio(uint64_t addr, uint32_t size,
+                                 bool pio = false);
+    void unregister_coalesced_mmio(uint64_t addr, uint32_t size,
+                                   bool pio = false);
+    // Signal eventfd efd on every len byte write to addr, in the kernel.
+    void add_ioeventfd(int efd, uint64_t addr, uint32_t len, bool pio = false);
+    void remove_ioeventfd(int efd, uint64_t addr, uint32_t len,
+                          bool pio = false);
     void set_tss_addr(uint32_t addr);
     system& sys() { return _system; }
+private:
+    // not copyable
+    vm(const vm&);
+    vm& operator=(const vm&);
 private:
     system& _system;
     fd _fd;
+    unsigned _dirty_ring_entries;
+    // The coalesced MMIO ring is shared by all vCPUs of the VM; this
+    // serializes the vCPUs draining it.
+    boost::mutex _coalesced_lock;
     friend class system;
     friend class vcpu;
 };
@@ -74,8 +184,11 @@ public:
     explicit system(std::string device_node = "/dev/kvm");
     bool check_extension(int extension);
     int get_extension_int(int extension);
+    // The MSRs KVM can save and restore, fetched once and cached.
+    const std::vector<uint32_t>& msr_index_list();
 private:
     fd _fd;
+    std::vector<uint32_t> _msr_index_list;
     friend class vcpu;
     friend class vm;
 };
@@ -1,5 +1,99 @@
 
 #include "memmap.hh"
+#include "exception.hh"
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace {
+
+const char* backing_names[] = { "4k", "thp", "2m", "1g" };
+const uint64_t backing_page_sizes[] = {
+    4096, 2ULL << 20, 2ULL << 20, 1ULL << 30,
+};
+
+}
+
+mem_backing::mem_backing(uint64_t size, type t, int numa_node)
+    : _type(t)
+{
+    uint64_t page = page_size();
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    _size = (size + page - 1) & ~(page - 1);
+    _map_size = _size;
+    if (t == hugetlb_2m || t == hugetlb_1g) {
+        flags |= MAP_HUGETLB | (__builtin_ctzll(page) << MAP_HUGE_SHIFT);
+    } else if (t == thp) {
+        // leave room to align the start to a huge page
+        _map_size += page;
+    }
+
+    _map = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (_map == MAP_FAILED) {
+        throw errno_exception(errno);
+    }
+    _addr = _map;
+    if (t == thp) {
+        uintptr_t a = reinterpret_cast<uintptr_t>(_map);
+        _addr = reinterpret_cast<void*>((a + page - 1) & ~uintptr_t(page - 1));
+        if (madvise(_addr, _size, MADV_HUGEPAGE)) {
+            int err = errno;
+            munmap(_map, _map_size);
+            throw errno_exception(err);
+        }
+    }
+    if (numa_node >= 0) {
+        // nothing has been touched yet, so this places every page
+        unsigned long mask[4] = {};
+        const int bits = sizeof(mask[0]) * 8;
+        if (numa_node >= int(sizeof(mask) * 8)) {
+            munmap(_map, _map_size);
+            throw errno_exception(EINVAL);
+        }
+        mask[numa_node / bits] = 1UL << (numa_node % bits);
+        if (syscall(__NR_mbind, _addr, _size, MPOL_BIND, mask,
+                    sizeof(mask) * 8, 0)) {
+            int err = errno;
+            munmap(_map, _map_size);
+            throw errno_exception(err);
+        }
+    }
+}
+
+mem_backing::~mem_backing()
+{
+    munmap(_map, _map_size);
+}
+
+uint64_t mem_backing::page_size() const
+{
+    return backing_page_sizes[_type];
+}
+
+const char* mem_backing::type_name(type t)
+{
+    return backing_names[t];
+}
+
+bool mem_backing::parse_type(const char* name, type& t)
+{
+    for (int i = 0; i < nr_types; ++i) {
+        if (!strcmp(name, backing_names[i])) {
+            t = type(i);
+            return true;
+        }
+    }
+    return false;
+}
 
 mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
     : _map(map)
@@ -34,18 +128,37 @@ void mem_slot::set_dirty_logging(bool enabled)
 {
     if (_dirty_log_enabled != enabled) {
         _dirty_log_enabled = enabled;
-        if (enabled) {
-            int logsize = ((_size >> 12) + bits_per_word - 1) / bits_per_word;
-            _log.resize(logsize);
-        } else {
-            _log.resize(0);
-        }
+        resize_log();
         if (_size) {
             update();
         }
     }
 }
 
+void mem_slot::resize_log()
+{
+    if (_dirty_log_enabled) {
+        // the kernel reads and writes the bitmap in 64-bit units
+        int logsize = (((_size >> 12) + 63) / 64) * (64 / bits_per_word);
+        _log.resize(logsize);
+    } else {
+        _log.resize(0);
+    }
+}
+
+void mem_slot::resize(uint64_t size)
+{
+    if (_size) {
+        _size = 0;
+        update();
+    }
+    _size = size;
+    resize_log();
+    if (_size) {
+        update();
+    }
+}
+
 void mem_slot::update()
 {
     uint32_t flags = 0;
@@ -73,11 +186,86 @@ bool mem_slot::is_dirty(uint64_t gpa) const
     return _log[wordnr] & bit;
 }
 
+uint64_t mem_slot::nr_dirty() const
+{
+    uint64_t n = 0;
+
+    for (size_t i = 0; i < _log.size(); ++i) {
+        n += __builtin_popcountl(_log[i]);
+    }
+    return n;
+}
+
+// Return the first page >= page whose dirty bit equals set, or the number
+// of pages in the slot.  Whole words that cannot match are skipped, four
+// at a time when looking for a set bit, which the compiler vectorizes.
+uint64_t mem_slot::next_bit(uint64_t page, bool set) const
+{
+    uint64_t npages = _size >> 12;
+    size_t nwords = _log.size();
+    ulong flip = set ? 0 : ~0UL;
+
+    if (page >= npages) {
+        return npages;
+    }
+
+    size_t i = page / bits_per_word;
+    ulong word = (_log[i] ^ flip) & (~0UL << (page % bits_per_word));
+    while (!word) {
+        if (++i == nwords) {
+            return npages;
+        }
+        if (set) {
+            while (i + 4 <= nwords
+                   && !(_log[i] | _log[i + 1] | _log[i + 2] | _log[i + 3])) {
+                i += 4;
+            }
+            if (i == nwords) {
+                return npages;
+            }
+        }
+        word = _log[i] ^ flip;
+    }
+    uint64_t found = uint64_t(i) * bits_per_word + __builtin_ctzl(word);
+    return found < npages ? found : npages;
+}
+
+void mem_slot::clear_dirty_log(uint64_t gpa, uint64_t size)
+{
+    uint64_t npages = _size >> 12;
+    uint64_t first = ((gpa - _gpa) >> 12) & ~uint64_t(63);
+    uint64_t last = (gpa - _gpa + size + 4095) >> 12;
+
+    last = std::min((last + 63) & ~uint64_t(63), npages);
+    if (first >= last) {
+        return;
+    }
+    _map._vm.clear_dirty_log(_slot, &_log[first / bits_per_word], first,
+                             last - first);
+}
+
+void mem_slot::clear_dirty_log()
+{
+    clear_dirty_log(_gpa, _size);
+}
+
 mem_map::mem_map(kvm::vm& vm)
     : _vm(vm)
+    , _manual_protect(false)
 {
     int nr_slots = vm.sys().get_extension_int(KVM_CAP_NR_MEMSLOTS);
     for (int i = 0; i < nr_slots; ++i) {
         _free_slots.push(i);
     }
 }
+
+bool mem_map::enable_manual_dirty_protect()
+{
+    if (!_vm.sys().check_extension(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2)) {
+        return false;
+    }
+    _vm.enable_cap(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2,
+                   KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+    _manual_protect = true;
+    return true;
+}
@@ -9,6 +9,35 @@
 class mem_map;
 class mem_slot;
 
+// Host memory to back guest memory with: plain anonymous 4K pages,
+// transparent huge pages, or hugetlbfs 2M/1G pages, optionally bound to
+// a NUMA node.  Throws errno_exception if the memory cannot be had.
+class mem_backing {
+public:
+    enum type { anon, thp, hugetlb_2m, hugetlb_1g, nr_types };
+    mem_backing(uint64_t size, type t = anon, int numa_node = -1);
+    ~mem_backing();
+    void* addr() const { return _addr; }
+    uint64_t size() const { return _size; }
+    type backing_type() const { return _type; }
+    // The host page size the memory is (or, for thp, hopes to be)
+    // mapped with.
+    uint64_t page_size() const;
+    const char* name() const { return type_name(_type); }
+    static const char* type_name(type t);
+    // Parse "4k", "thp", "2m" or "1g"; returns false if t is unknown.
+    static bool parse_type(const char* name, type& t);
+private:
+    mem_backing(const mem_backing&);
+    mem_backing& operator=(const mem_backing&);
+private:
+    type _type;
+    uint64_t _size;
+    void* _addr;
+    void* _map;
+    uint64_t _map_size;
+};
+
 class mem_slot {
 public:
     mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void *hva);
@@ -17,8 +46,25 @@ public:
     bool dirty_logging() const;
     void update_dirty_log();
     bool is_dirty(uint64_t gpa) const;
+    uint64_t nr_dirty() const;
+    // Call f(gpa, len) for each maximal run of dirty pages in the log
+    // fetched by the last update_dirty_log(); returns f, like
+    // std::for_each().
+    template <typename F>
+    F for_each_dirty_range(F f) const;
+    // Re-protect the dirty pages of [gpa, gpa + size) as recorded in the
+    // last update_dirty_log(); needs manual protect (see mem_map).  The
+    // range is widened to 64-page boundaries, as the kernel requires.
+    void clear_dirty_log(uint64_t gpa, uint64_t size);
+    void clear_dirty_log();
+    // Change the size of the slot.  KVM cannot resize a slot in place,
+    // so this deletes it and registers it again; a size of 0 leaves it
+    // deleted, but the slot number stays reserved.
+    void resize(uint64_t size);
 private:
     void update();
+    void resize_log();
+    uint64_t next_bit(uint64_t page, bool set) const;
 private:
     typedef unsigned long ulong;
     static const int bits_per_word = sizeof(ulong) * 8;
@@ -34,10 +80,31 @@ private:
 class mem_map {
 public:
     mem_map(kvm::vm& vm);
+    // With manual protect, KVM_GET_DIRTY_LOG no longer write-protects the
+    // pages it reports; mem_slot::clear_dirty_log() does, a chunk at a
+    // time.  Returns false if the kernel does not support it.
+    bool enable_manual_dirty_protect();
+    bool manual_dirty_protect() const { return _manual_protect; }
+    int nr_free_slots() const { return _free_slots.size(); }
 private:
     kvm::vm& _vm;
+    bool _manual_protect;
     std::stack<int> _free_slots;
     friend class mem_slot;
 };
 
+template <typename F>
+F mem_slot::for_each_dirty_range(F f) const
+{
+    uint64_t npages = _size >> 12;
+    uint64_t start, end;
+
+    for (start = next_bit(0, true); start < npages;
+         start = next_bit(end, true)) {
+        end = next_bit(start, false);
+        f(_gpa + (start << 12), (end - start) << 12);
+    }
+    return f;
+}
+
 #endif
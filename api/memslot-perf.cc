@@ -0,0 +1,284 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Create, toggle dirty logging on, resize and delete memory slots while
+// vCPUs run, and report how long each KVM_SET_USER_MEMORY_REGION takes
+// and the longest gap the vCPUs see in their own progress meanwhile.
+
+namespace {
+
+const int page_size	= 4096;
+// churned slots live above the 4G identity map
+const uint64_t slot_base = 1ULL << 32;
+int max_slots		= 4096;
+int slot_pages		= 16;
+int nr_vcpus		= 1;
+mem_backing::type backing = mem_backing::anon;
+int numa_node		= -1;
+std::vector<int> host_cpus;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t)hi << 32 | lo;
+}
+
+// Written by the guest through the identity map, one per vCPU.
+struct vcpu_progress {
+    uint64_t iterations;
+    uint64_t max_gap;
+    char pad[48];
+};
+
+volatile bool guest_stop;
+std::vector<vcpu_progress> progress;
+
+// Spin until told to stop, recording the longest time between two
+// iterations: that is how long the vCPU was kept out of the guest.
+void guest_spin(int i)
+{
+    vcpu_progress* p = &progress[i];
+    uint64_t last = rdtsc(), now;
+
+    while (!guest_stop) {
+        now = rdtsc();
+        if (now - last > p->max_gap) {
+            p->max_gap = now - last;
+        }
+        last = now;
+        ++p->iterations;
+    }
+}
+
+struct op_stats {
+    op_stats() : nr(0), total_ns(0), max_ns(0) {}
+    void add(uint64_t ns) {
+        ++nr;
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+    }
+    int nr;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+enum op { op_create, op_log_on, op_log_off, op_resize, op_delete, nr_ops };
+const char* op_names[] = { "create", "log-on", "log-off", "resize", "delete" };
+
+// The slots of one round, all aliasing the same host buffer.
+class churn {
+public:
+    churn(mem_map& memmap, void* backing)
+        : _memmap(memmap), _backing(backing) {}
+    ~churn();
+    void run(op o, int nr_slots, op_stats& st);
+private:
+    uint64_t slot_gpa(int i) const {
+        return slot_base + uint64_t(i) * 2 * slot_pages * page_size;
+    }
+private:
+    mem_map& _memmap;
+    void* _backing;
+    std::vector<mem_slot*> _slots;
+};
+
+churn::~churn()
+{
+    for (size_t i = 0; i < _slots.size(); ++i) {
+        delete _slots[i];
+    }
+}
+
+void churn::run(op o, int nr_slots, op_stats& st)
+{
+    uint64_t size = slot_pages * page_size;
+
+    for (int i = 0; i < nr_slots; ++i) {
+        uint64_t start_ns = time_ns();
+        switch (o) {
+        case op_create:
+            _slots.push_back(new mem_slot(_memmap, slot_gpa(i), size,
+                                          _backing));
+            break;
+        case op_log_on:
+            _slots[i]->set_dirty_logging(true);
+            break;
+        case op_log_off:
+            _slots[i]->set_dirty_logging(false);
+            break;
+        case op_resize:
+            // grow into the gap left after each slot
+            _slots[i]->resize(2 * size);
+            break;
+        case op_delete:
+            delete _slots[i];
+            _slots[i] = NULL;
+            break;
+        default:
+            break;
+        }
+        st.add(time_ns() - start_ns);
+    }
+    if (o == op_delete) {
+        _slots.clear();
+    }
+}
+
+void print_stats(int nr_slots, const char* name, const op_stats& st)
+{
+    uint64_t max_gap = 0, iterations = 0;
+
+    for (size_t i = 0; i < progress.size(); ++i) {
+        max_gap = std::max(max_gap, progress[i].max_gap);
+        iterations += progress[i].iterations;
+    }
+    printf("%5d slots: %-8s %10lld ns avg %10lld ns max, "
+           "vcpu stall %12lld cycles max, %12lld guest iterations\n",
+           nr_slots, name, st.nr ? st.total_ns / st.nr : 0, st.max_ns,
+           max_gap, iterations);
+}
+
+// Run one kind of operation over nr_slots slots with the vCPUs spinning.
+void run_op(identity::vcpu_pool& pool, churn& c, op o, int nr_slots)
+{
+    op_stats st;
+
+    memset(&progress[0], 0, progress.size() * sizeof(progress[0]));
+    guest_stop = false;
+    pool.start(guest_spin);
+    c.run(o, nr_slots, st);
+    guest_stop = true;
+    pool.wait();
+    print_stats(nr_slots, op_names[o], st);
+}
+
+// The stall the vCPUs see anyway, over a comparable interval.
+void run_idle(identity::vcpu_pool& pool, int nr_slots, uint64_t ns)
+{
+    memset(&progress[0], 0, progress.size() * sizeof(progress[0]));
+    guest_stop = false;
+    pool.start(guest_spin);
+    struct timespec ts = { time_t(ns / 1000000000), long(ns % 1000000000) };
+    nanosleep(&ts, NULL);
+    guest_stop = true;
+    pool.wait();
+    print_stats(nr_slots, "idle", op_stats());
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "b:c:n:N:p:v:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (!mem_backing::parse_type(optarg, backing)) {
+                printf("memslot-perf: Invalid backing: -b %s "
+                       "(4k, thp, 2m or 1g)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            numa_node = atoi(optarg);
+            break;
+        case 'c':
+            // host cpu for each vCPU, in order: -c 2,3,4,5
+            for (char* p = optarg; *p; ) {
+                errno = 0;
+                long cpu = strtol(p, &endptr, 10);
+                if (errno || endptr == p || cpu < 0
+                    || (*endptr && *endptr != ',')) {
+                    printf("memslot-perf: Invalid cpu list: -c %s\n",
+                           optarg);
+                    exit(1);
+                }
+                host_cpus.push_back(cpu);
+                p = *endptr ? endptr + 1 : endptr;
+            }
+            break;
+        case 'n':
+            max_slots = atoi(optarg);
+            if (max_slots <= 0) {
+                printf("memslot-perf: Invalid number: -n %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            slot_pages = atoi(optarg);
+            if (slot_pages <= 0) {
+                printf("memslot-perf: Invalid number: -p %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'v':
+            nr_vcpus = atoi(optarg);
+            if (nr_vcpus <= 0) {
+                printf("memslot-perf: Invalid number: -v %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("memslot-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    parse_options(ac, av);
+
+    identity::vm ident_vm(vm, memmap);
+    identity::vcpu_pool pool(vm, nr_vcpus, host_cpus);
+    progress.resize(nr_vcpus);
+
+    if (max_slots > memmap.nr_free_slots()) {
+        max_slots = memmap.nr_free_slots();
+    }
+    mem_backing mem(2 * slot_pages * page_size, backing, numa_node);
+    printf("memslot-perf: up to %d slots of %d pages, %d vcpus, "
+           "%s backing\n", max_slots, slot_pages, nr_vcpus, mem.name());
+
+    for (int n = 1; ; n = std::min(n * 2, max_slots)) {
+        churn c(memmap, mem.addr());
+        uint64_t start_ns = time_ns();
+
+        for (int o = 0; o < nr_ops; ++o) {
+            run_op(pool, c, op(o), n);
+        }
+        run_idle(pool, n, (time_ns() - start_ns) / nr_ops);
+        if (n == max_slots) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
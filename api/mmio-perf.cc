@@ -0,0 +1,253 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include <boost/thread/thread.hpp>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Compare three ways of getting a guest write to an MMIO address or an
+// I/O port to the host: a plain exit to userspace, the coalesced MMIO
+// ring, and an ioeventfd consumed by another thread.
+
+namespace {
+
+const int page_size	= 4096;
+const uint16_t port	= 0x1000;
+int64_t nr_writes	= 1000000;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t)hi << 32 | lo;
+}
+
+// Runs in the guest; the result lands in host memory through the
+// identity map.
+void guest_mmio(volatile uint32_t* addr, uint64_t* cycles)
+{
+    uint64_t start = rdtsc();
+    for (int64_t i = 0; i < nr_writes; ++i) {
+        *addr = i;
+    }
+    *cycles = rdtsc() - start;
+}
+
+void guest_pio(uint64_t* cycles)
+{
+    uint64_t start = rdtsc();
+    for (int64_t i = 0; i < nr_writes; ++i) {
+        asm volatile("outl %0, %1" : : "a"((uint32_t)i), "d"(port));
+    }
+    *cycles = rdtsc() - start;
+}
+
+struct consumer {
+    int64_t consumed;
+};
+
+// identity::vcpu ends the guest with an outb to port 0.
+bool handle_io(kvm::vcpu& vcpu, void* opaque)
+{
+    kvm_run* run = vcpu.shared();
+
+    if (run->io.port == 0) {
+        return false;
+    }
+    static_cast<consumer*>(opaque)->consumed += run->io.count;
+    return true;
+}
+
+bool handle_mmio(kvm::vcpu& vcpu, void* opaque)
+{
+    ++static_cast<consumer*>(opaque)->consumed;
+    return true;
+}
+
+void handle_coalesced(kvm::vcpu& vcpu, const kvm_coalesced_mmio& mmio,
+                      void* opaque)
+{
+    ++static_cast<consumer*>(opaque)->consumed;
+}
+
+const kvm::exit_handler handlers[] = {
+    { KVM_EXIT_IO, handle_io },
+    { KVM_EXIT_MMIO, handle_mmio },
+};
+
+const kvm::exit_table exit_table = {
+    handlers, sizeof(handlers) / sizeof(handlers[0]), handle_coalesced,
+};
+
+// Sleep in poll() until the ioeventfd or stop_efd fires.  stop_efd is
+// written once the guest is done; efd is then read one last time, so
+// that the signals since the previous read are counted as well.
+void eventfd_consumer(int efd, int stop_efd, consumer& c)
+{
+    pollfd fds[2] = { { efd, POLLIN, 0 }, { stop_efd, POLLIN, 0 } };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        bool done = fds[1].revents & POLLIN;
+        uint64_t n;
+        if (read(efd, &n, sizeof(n)) == sizeof(n)) {
+            c.consumed += n;
+        }
+        if (done) {
+            return;
+        }
+    }
+}
+
+enum mode { mode_exit, mode_coalesced, mode_ioeventfd };
+const char* mode_names[] = { "exit", "coalesced", "ioeventfd" };
+
+using boost::ref;
+using std::tr1::bind;
+
+void run_one(kvm::vm& vm, kvm::vcpu& vcpu, void* mmio_page, bool pio,
+             mode m)
+{
+    uint64_t addr = pio ? port : reinterpret_cast<uintptr_t>(mmio_page);
+    uint64_t cycles = 0;
+    consumer c = {};
+    int efd = -1, stop_efd = -1;
+    boost::thread* thread = NULL;
+
+    if (m == mode_coalesced) {
+        vm.register_coalesced_mmio(addr, 4, pio);
+    } else if (m == mode_ioeventfd) {
+        efd = eventfd(0, EFD_NONBLOCK);
+        stop_efd = eventfd(0, 0);
+        if (efd < 0 || stop_efd < 0) {
+            throw errno_exception(errno);
+        }
+        vm.add_ioeventfd(efd, addr, 4, pio);
+        thread = new boost::thread(eventfd_consumer, efd, stop_efd, ref(c));
+    }
+
+    std::tr1::function<void ()> guest;
+    if (pio) {
+        guest = bind(guest_pio, &cycles);
+    } else {
+        guest = bind(guest_mmio, static_cast<volatile uint32_t*>(mmio_page),
+                     &cycles);
+    }
+    identity::vcpu guest_thread(vcpu, guest);
+
+    vcpu.reset_stats();
+    uint64_t start_ns = time_ns();
+    vcpu.run_loop(exit_table, &c);
+    if (thread) {
+        uint64_t one = 1;
+        if (write(stop_efd, &one, sizeof(one)) != sizeof(one)) {
+            throw errno_exception(errno);
+        }
+        thread->join();
+        delete thread;
+    }
+    uint64_t ns = time_ns() - start_ns;
+
+    if (m == mode_coalesced) {
+        vm.unregister_coalesced_mmio(addr, 4, pio);
+    } else if (m == mode_ioeventfd) {
+        vm.remove_ioeventfd(efd, addr, 4, pio);
+        close(efd);
+        close(stop_efd);
+    }
+
+    const kvm::exit_stats& st = vcpu.stats();
+    uint64_t exits = 0;
+    for (unsigned i = 0; i < kvm::exit_stats::nr_reasons; ++i) {
+        exits += st.count[i];
+    }
+    printf("%-4s %-10s: %8lld cycles/write, %10lld consumed, "
+           "%10lld consumed/sec, %8lld exits\n",
+           pio ? "pio" : "mmio", mode_names[m], cycles / nr_writes,
+           c.consumed, ns ? c.consumed * 1000000000LL / (int64_t)ns : 0,
+           exits);
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            errno = 0;
+            nr_writes = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || nr_writes <= 0) {
+                printf("mmio-perf: Invalid number: -n %s\n", optarg);
+                exit(1);
+            }
+            if (*endptr == 'k' || *endptr == 'K') {
+                nr_writes *= 1024;
+            }
+            break;
+        default:
+            printf("mmio-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+    printf("mmio-perf: %lld writes per run\n", nr_writes);
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    parse_options(ac, av);
+
+    // MMIO goes to a page that is left out of the identity map
+    void* mmio_page;
+    if (posix_memalign(&mmio_page, page_size, page_size)) {
+        printf("mmio-perf: Could not allocate the MMIO page.\n");
+        exit(1);
+    }
+    identity::hole hole(mmio_page, page_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+
+    bool coalesced = sys.check_extension(KVM_CAP_COALESCED_MMIO);
+    bool coalesced_pio = sys.check_extension(KVM_CAP_COALESCED_PIO);
+    bool ioeventfd = sys.check_extension(KVM_CAP_IOEVENTFD);
+
+    for (int pio = 0; pio < 2; ++pio) {
+        run_one(vm, vcpu, mmio_page, pio, mode_exit);
+        if (pio ? coalesced_pio : coalesced) {
+            run_one(vm, vcpu, mmio_page, pio, mode_coalesced);
+        }
+        if (ioeventfd) {
+            run_one(vm, vcpu, mmio_page, pio, mode_ioeventfd);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,321 @@
+/*
+ * Measure the cost of the common guest exits: an hvc handled by KVM's
+ * PSCI code, an MMIO read handled by QEMU, a trapped system register
+ * read, a virtual timer expiry and a GIC SGI to another CPU.
+ *
+ * Usage: vmexit.flat [bench] [test...]
+ *
+ * Like x86/vmexit.c each test doubles its iteration count until a run
+ * lasts GOAL_MS and then prints the average cost of one call in ns.
+ * Parallel tests run on every CPU at the same time.  With "bench" each
+ * test is timed with lib/bench.c instead and prints BENCH: lines, one
+ * per CPU for parallel tests.
+ *
+ * The vtimer and ipi tests need a GICv2; they are skipped otherwise.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include <devicetree.h>
+#include <bench.h>
+#include <asm/setup.h>
+#include <asm/psci.h>
+#include <asm/smp.h>
+#include <asm/io.h>
+#include <asm/barrier.h>
+
+#define GOAL_MS		250
+
+#define UART01x_FR	0x18
+
+#define GICD_CTLR	0x000
+#define GICD_ISENABLER	0x100
+#define GICD_SGIR	0xf00
+#define GICC_CTLR	0x000
+#define GICC_PMR	0x004
+#define GICC_IAR	0x00c
+#define GICC_EOIR	0x010
+#define GICC_INT_SPURIOUS	1023
+
+#define IPI_SGI		0
+/* PPI 11, the virtual timer on QEMU's mach-virt */
+#define VTIMER_IRQ	27
+
+#define CNTV_CTL_ENABLE	(1 << 0)
+
+struct test {
+	void (*func)(void);
+	const char *name;
+	bool (*valid)(void);
+	int parallel;
+	void (*begin)(void);
+	void (*end)(void);
+};
+
+static bool bench_mode;
+static u64 iterations;
+static void *gicd_base, *gicc_base;
+
+static void hvc(void)
+{
+	psci_invoke(PSCI_0_2_FN_PSCI_VERSION, 0, 0, 0);
+}
+
+static void mmio_uart(void)
+{
+	readl(uart0_base + UART01x_FR);
+}
+
+/* ACTLR is trapped by HCR.TAC(R) and emulated by KVM.  */
+static void read_actlr(void)
+{
+#if defined(__arm__)
+	asm volatile("mrc p15, 0, r0, c1, c0, 1" : : : "r0");
+#elif defined(__aarch64__)
+	asm volatile("mrs x0, actlr_el1" : : : "x0");
+#endif
+}
+
+static void vtimer_write(u64 cval, u32 ctl)
+{
+#if defined(__arm__)
+	asm volatile("mcrr p15, 3, %Q0, %R0, c14" : : "r" (cval));
+	asm volatile("mcr p15, 0, %0, c14, c3, 1" : : "r" (ctl));
+#elif defined(__aarch64__)
+	asm volatile("msr cntv_cval_el0, %0" : : "r" (cval));
+	asm volatile("msr cntv_ctl_el0, %0" : : "r" ((u64)ctl));
+#endif
+	isb();
+}
+
+/*
+ * IRQs stay masked in PSTATE, so pending interrupts are picked up by
+ * polling the CPU interface instead of taking an exception.
+ */
+static u32 gic_wait_irq(void)
+{
+	u32 iar;
+
+	do
+		iar = readl(gicc_base + GICC_IAR);
+	while ((iar & 0x3ff) == GICC_INT_SPURIOUS);
+	return iar;
+}
+
+/*
+ * Arm the timer in the past: the host takes the physical interrupt,
+ * exits and injects it, and the guest sees it at its CPU interface.
+ */
+static void vtimer(void)
+{
+	u32 iar;
+
+	vtimer_write(bench_cycles(), CNTV_CTL_ENABLE);
+	iar = gic_wait_irq();
+	vtimer_write(0, 0);
+	writel(iar, gicc_base + GICC_EOIR);
+}
+
+static volatile unsigned int ipi_sent, ipi_received;
+static volatile bool ipi_stop;
+
+static void ipi_responder(void *data __unused)
+{
+	u32 iar;
+
+	while (!ipi_stop) {
+		iar = readl(gicc_base + GICC_IAR);
+		if ((iar & 0x3ff) == GICC_INT_SPURIOUS)
+			continue;
+		writel(iar, gicc_base + GICC_EOIR);
+		if ((iar & 0x3ff) == IPI_SGI)
+			++ipi_received;
+	}
+}
+
+static void ipi_begin(void)
+{
+	ipi_stop = false;
+	on_cpu_async(1, ipi_responder, NULL);
+}
+
+static void ipi_end(void)
+{
+	ipi_stop = true;
+	while (!cpu_is_idle(1))
+		wfe();
+}
+
+/* Send an SGI to CPU 1 and wait until it has been acknowledged.  */
+static void ipi(void)
+{
+	unsigned int sent = ++ipi_sent;
+
+	smp_mb();
+	writel((1 << (16 + 1)) | IPI_SGI, gicd_base + GICD_SGIR);
+	while (ipi_received != sent)
+		cpu_relax();
+}
+
+static bool gic_valid(void)
+{
+	return gicd_base != NULL;
+}
+
+static bool ipi_valid(void)
+{
+	return gic_valid() && nr_cpus >= 2;
+}
+
+static struct test tests[] = {
+	{ .func = hvc, .name = "hvc", .parallel = 1 },
+	{ .func = mmio_uart, .name = "mmio_uart", .parallel = 1 },
+	{ .func = read_actlr, .name = "read_actlr", .parallel = 1 },
+	{ .func = vtimer, .name = "vtimer", .valid = gic_valid, .parallel = 1 },
+	{ .func = ipi, .name = "ipi", .valid = ipi_valid,
+	  .begin = ipi_begin, .end = ipi_end },
+};
+
+static void gic_cpu_init(void *data __unused)
+{
+	/* SGIs and PPIs are banked, so every CPU enables its own */
+	writel((1 << IPI_SGI) | (1 << VTIMER_IRQ), gicd_base + GICD_ISENABLER);
+	writel(0xff, gicc_base + GICC_PMR);
+	writel(1, gicc_base + GICC_CTLR);
+}
+
+static void gic_init(void)
+{
+	struct dt_pbus_reg reg;
+	int node, ret;
+
+	node = fdt_node_offset_by_compatible(dt_fdt(), -1,
+					     "arm,cortex-a15-gic");
+	if (node < 0) {
+		printf("no GICv2 found, skipping vtimer and ipi\n");
+		return;
+	}
+
+	ret = dt_pbus_translate_node(node, 0, &reg);
+	assert(ret == 0);
+	gicd_base = ioremap(reg.addr, reg.size);
+	ret = dt_pbus_translate_node(node, 1, &reg);
+	assert(ret == 0);
+	gicc_base = ioremap(reg.addr, reg.size);
+
+	writel(1, gicd_base + GICD_CTLR);
+	on_cpus(gic_cpu_init, NULL);
+}
+
+static void run_test(void *data)
+{
+	void (*func)(void) = data;
+	u64 i;
+
+	for (i = 0; i < iterations; ++i)
+		func();
+}
+
+static void bench_call(void *func)
+{
+	((void (*)(void))func)();
+}
+
+/*
+ * Time the test with lib/bench.c and print BENCH: lines, one per CPU for
+ * parallel tests, which run on every CPU at the same time.
+ */
+static void do_test_bench(struct test *test)
+{
+	static struct bench_result results[NR_CPUS];
+	struct bench b = {
+		.name = test->name, .func = bench_call, .data = test->func,
+	};
+	int cpu;
+
+	if (!test->parallel) {
+		bench_one(&b);
+		return;
+	}
+	bench_run_cpus(&b, results, nr_cpus);
+	for (cpu = 0; cpu < nr_cpus; ++cpu)
+		bench_print(&b, &results[cpu]);
+}
+
+static void do_test(struct test *test)
+{
+	u64 goal = bench_hz() * GOAL_MS / 1000, t1, t2;
+
+	if (test->valid && !test->valid()) {
+		printf("%s (skipped)\n", test->name);
+		return;
+	}
+
+	if (test->begin)
+		test->begin();
+
+	if (bench_mode) {
+		do_test_bench(test);
+	} else {
+		iterations = 32;
+		do {
+			iterations *= 2;
+			t1 = bench_cycles();
+			if (!test->parallel)
+				run_test(test->func);
+			else
+				on_cpus(run_test, test->func);
+			t2 = bench_cycles();
+		} while (t2 - t1 < goal);
+
+		/* scaled so that nothing overflows 64 bits */
+		printf("%s %" PRIu64 "\n", test->name, (t2 - t1) * 1000000
+		       / (bench_hz() / 1000) / iterations);
+	}
+
+	if (test->end)
+		test->end();
+}
+
+static bool test_wanted(struct test *test, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], test->name) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int cpu;
+
+	for_each_present_cpu(cpu) {
+		if (cpu == 0)
+			continue;
+		smp_boot_secondary(cpu, do_idle);
+	}
+
+	gic_init();
+
+	/* "bench" as the first argument prints BENCH: lines */
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench_mode = true;
+		argc--, argv++;
+	} else {
+		printf("counter frequency %" PRIu64 " Hz, "
+		       "cost per call in ns\n", bench_hz());
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (test_wanted(&tests[i], argv + 1, argc - 1))
+			do_test(&tests[i]);
+
+	return 0;
+}
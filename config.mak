@@ -0,0 +1,16 @@
+PREFIX=/usr/local
+HOST=x86_64
+ARCH=x86_64
+ARCH_NAME=x86_64
+PROCESSOR=x86_64
+CC=gcc
+LD=ld
+OBJCOPY=objcopy
+OBJDUMP=objdump
+AR=ar
+ADDR2LINE=addr2line
+API=
+TEST_DIR=x86
+FIRMWARE=
+ENDIAN=
+PRETTY_PRINT_STACKS=yes
@@ -6,35 +6,82 @@
 #include "alloc.h"
 #include "asm/spinlock.h"
 #include "asm/io.h"
+#include "asm/page.h"
 
 #define MIN(a, b)		((a) < (b) ? (a) : (b))
 #define MAX(a, b)		((a) > (b) ? (a) : (b))
 
-#define PHYS_ALLOC_NR_REGIONS	256
+#define PHYS_ALLOC_LOG_ENTRIES	64
+#define PHYS_ALLOC_NR_CPUS	64
+#define PHYS_ALLOC_MAGAZINE_SIZE	(16 * PAGE_SIZE)
 
 struct phys_alloc_region {
 	phys_addr_t base;
 	phys_addr_t size;
 };
 
-static struct phys_alloc_region regions[PHYS_ALLOC_NR_REGIONS];
-static int nr_regions;
+/*
+ * The allocation log is a list of chunks. The first chunk of the global
+ * log is static, all others are carved from the memory being allocated.
+ */
+struct phys_alloc_log {
+	struct phys_alloc_log *next;
+	int nr;
+	struct phys_alloc_region regions[PHYS_ALLOC_LOG_ENTRIES];
+};
+
+/*
+ * A magazine is a chunk of the global pool owned by a single cpu, which
+ * serves small allocations from it without taking the lock. Allocations
+ * from a magazine are logged in the cpu's own log. Since a cpu only ever
+ * touches its own magazine, the only requirement is that the allocator
+ * isn't reentered from an interrupt handler on the same cpu.
+ */
+struct phys_alloc_magazine {
+	phys_addr_t base, top;
+	struct phys_alloc_log *log, *log_tail;
+} __attribute__((aligned(64)));
+
+static struct phys_alloc_log global_log;
+static struct phys_alloc_log *global_log_tail = &global_log;
+
+static struct phys_alloc_magazine magazines[PHYS_ALLOC_NR_CPUS];
+static int (*phys_alloc_cpu_id)(void);
 
 static struct spinlock lock;
 static phys_addr_t base, top, align_min;
 
-void phys_alloc_show(void)
+static void phys_alloc_log_show(struct phys_alloc_log *log)
 {
 	int i;
 
+	for (; log; log = log->next)
+		for (i = 0; i < log->nr; ++i)
+			printf("%016" PRIx64 "-%016" PRIx64 " [%s]\n",
+				(u64)log->regions[i].base,
+				(u64)(log->regions[i].base +
+				      log->regions[i].size - 1),
+				"USED");
+}
+
+void phys_alloc_show(void)
+{
+	struct phys_alloc_magazine *mag;
+	int cpu;
+
 	spin_lock(&lock);
 	printf("phys_alloc minimum alignment: 0x%" PRIx64 "\n",
 		(u64)align_min);
-	for (i = 0; i < nr_regions; ++i)
-		printf("%016" PRIx64 "-%016" PRIx64 " [%s]\n",
-			(u64)regions[i].base,
-			(u64)(regions[i].base + regions[i].size - 1),
-			"USED");
+	phys_alloc_log_show(&global_log);
+	for (cpu = 0; cpu < PHYS_ALLOC_NR_CPUS; ++cpu)
+		phys_alloc_log_show(magazines[cpu].log);
+	for (cpu = 0; cpu < PHYS_ALLOC_NR_CPUS; ++cpu) {
+		mag = &magazines[cpu];
+		if (mag->base != mag->top)
+			printf("%016" PRIx64 "-%016" PRIx64 " [%s cpu%d]\n",
+				(u64)mag->base, (u64)(mag->top - 1),
+				"FREE", cpu);
+	}
 	printf("%016" PRIx64 "-%016" PRIx64 " [%s]\n",
 		(u64)base, (u64)(top - 1), "FREE");
 	spin_unlock(&lock);
@@ -46,7 +93,10 @@ void phys_alloc_init(phys_addr_t base_addr, phys_addr_t size)
 	base = base_addr;
 	top = base + size;
 	align_min = DEFAULT_MINIMUM_ALIGNMENT;
-	nr_regions = 0;
+	global_log.next = NULL;
+	global_log.nr = 0;
+	global_log_tail = &global_log;
+	memset(magazines, 0, sizeof(magazines));
 	spin_unlock(&lock);
 }
 
@@ -58,50 +108,170 @@ void phys_alloc_set_minimum_alignment(phys_addr_t align)
 	spin_unlock(&lock);
 }
 
-static phys_addr_t phys_alloc_aligned_safe(phys_addr_t size,
-					   phys_addr_t align, bool safe)
+void phys_alloc_set_cpu_id(int (*cpu_id)(void))
 {
-	static bool warned = false;
-	phys_addr_t addr, size_orig = size;
-	u64 top_safe;
-
 	spin_lock(&lock);
+	phys_alloc_cpu_id = cpu_id;
+	spin_unlock(&lock);
+}
+
+/*
+ * Carve @size bytes aligned to @align from [*@basep, @limit), advancing
+ * *@basep past them.
+ */
+static phys_addr_t carve(phys_addr_t *basep, phys_addr_t limit,
+			 phys_addr_t size, phys_addr_t align)
+{
+	phys_addr_t addr = ALIGN(*basep, align);
+
+	if (addr < *basep || addr > limit || limit - addr < size)
+		return INVALID_PHYS_ADDR;
 
-	top_safe = top;
+	*basep = addr + size;
+	return addr;
+}
 
+static phys_addr_t safe_top(bool safe)
+{
 	if (safe && sizeof(long) == 4)
-		top_safe = MIN(top_safe, 1ULL << 32);
+		return MIN(top, 1ULL << 32);
+	return top;
+}
 
-	align = MAX(align, align_min);
+/*
+ * Append a region to the log ending at *@tailp. New log chunks are taken
+ * from the global pool, so @locked tells whether the caller holds the
+ * lock already.
+ */
+static void log_region(struct phys_alloc_log **headp,
+		       struct phys_alloc_log **tailp,
+		       phys_addr_t addr, phys_addr_t size, bool locked)
+{
+	static bool warned = false;
+	struct phys_alloc_log *log = *tailp;
+	phys_addr_t chunk;
+
+	if (!log || log->nr == PHYS_ALLOC_LOG_ENTRIES) {
+		if (!locked)
+			spin_lock(&lock);
+		chunk = carve(&base, safe_top(true), sizeof(*log), align_min);
+		if (!locked)
+			spin_unlock(&lock);
+		if (chunk == INVALID_PHYS_ADDR) {
+			if (!warned) {
+				printf("WARNING: phys_alloc: No free log "
+				       "entries, can no longer log "
+				       "allocations...\n");
+				warned = true;
+			}
+			return;
+		}
+		log = phys_to_virt(chunk);
+		log->next = NULL;
+		log->nr = 0;
+		if (*tailp)
+			(*tailp)->next = log;
+		else
+			*headp = log;
+		*tailp = log;
+	}
+
+	log->regions[log->nr].base = addr;
+	log->regions[log->nr].size = size;
+	++log->nr;
+}
+
+static phys_addr_t global_alloc(phys_addr_t size, phys_addr_t align,
+				bool safe)
+{
+	phys_addr_t addr;
+	u64 top_safe;
 
-	addr = ALIGN(base, align);
-	size += addr - base;
+	spin_lock(&lock);
 
-	if ((top_safe - base) < size) {
+	top_safe = safe_top(safe);
+	addr = carve(&base, top_safe, size, align);
+	if (addr == INVALID_PHYS_ADDR) {
 		printf("phys_alloc: requested=0x%" PRIx64
 		       " (align=0x%" PRIx64 "), "
 		       "need=0x%" PRIx64 ", but free=0x%" PRIx64 ". "
 		       "top=0x%" PRIx64 ", top_safe=0x%" PRIx64 "\n",
-		       (u64)size_orig, (u64)align, (u64)size, top_safe - base,
+		       (u64)size, (u64)align,
+		       (u64)(size + ALIGN(base, align) - base),
+		       base < top_safe ? top_safe - base : 0,
 		       (u64)top, top_safe);
 		spin_unlock(&lock);
 		return INVALID_PHYS_ADDR;
 	}
 
-	base += size;
+	log_region(NULL, &global_log_tail, addr, size, true);
 
-	if (nr_regions < PHYS_ALLOC_NR_REGIONS) {
-		regions[nr_regions].base = addr;
-		regions[nr_regions].size = size_orig;
-		++nr_regions;
-	} else if (!warned) {
-		printf("WARNING: phys_alloc: No free log entries, "
-		       "can no longer log allocations...\n");
-		warned = true;
-	}
+	spin_unlock(&lock);
+
+	return addr;
+}
+
+/*
+ * Give the unused tail of @mag back to the global pool when possible, and
+ * refill it with a fresh chunk. Magazines are always taken from safe
+ * memory, so they can serve both kinds of request.
+ */
+static bool magazine_refill(struct phys_alloc_magazine *mag)
+{
+	phys_addr_t chunk;
 
+	spin_lock(&lock);
+	if (mag->top && mag->top == base)
+		base = mag->base;
+	chunk = carve(&base, safe_top(true), PHYS_ALLOC_MAGAZINE_SIZE,
+		      align_min);
+	if (chunk == INVALID_PHYS_ADDR) {
+		mag->base = mag->top = 0;
+		spin_unlock(&lock);
+		return false;
+	}
 	spin_unlock(&lock);
 
+	mag->base = chunk;
+	mag->top = chunk + PHYS_ALLOC_MAGAZINE_SIZE;
+	return true;
+}
+
+static struct phys_alloc_magazine *this_magazine(void)
+{
+	int cpu;
+
+	if (!phys_alloc_cpu_id)
+		return NULL;
+
+	cpu = phys_alloc_cpu_id();
+	if (cpu < 0 || cpu >= PHYS_ALLOC_NR_CPUS)
+		return NULL;
+
+	return &magazines[cpu];
+}
+
+static phys_addr_t phys_alloc_aligned_safe(phys_addr_t size,
+					   phys_addr_t align, bool safe)
+{
+	struct phys_alloc_magazine *mag = this_magazine();
+	phys_addr_t addr;
+
+	align = MAX(align, align_min);
+
+	if (!mag || size + align > PHYS_ALLOC_MAGAZINE_SIZE / 4)
+		return global_alloc(size, align, safe);
+
+	addr = carve(&mag->base, mag->top, size, align);
+	if (addr == INVALID_PHYS_ADDR) {
+		if (!magazine_refill(mag))
+			return global_alloc(size, align, safe);
+		addr = carve(&mag->base, mag->top, size, align);
+		assert(addr != INVALID_PHYS_ADDR);
+	}
+
+	log_region(&mag->log, &mag->log_tail, addr, size, false);
+
 	return addr;
 }
 
@@ -180,3 +350,283 @@ static struct alloc_ops early_alloc_ops = {
 };
 
 struct alloc_ops *alloc_ops = &early_alloc_ops;
+
+/*
+ * heap_alloc_ops
+ *
+ * Every page owned by the heap starts with a struct heap_page. Slab pages
+ * hold objects of a single power of two size class, placed at multiples
+ * of the object size after the header. A large allocation is a run of
+ * pages whose header sits in the page that contains the byte just before
+ * the returned pointer, so for any pointer p handed out by the heap, the
+ * header is found at (p - 1) & PAGE_MASK.
+ *
+ * Pages are recycled through a free run list, sorted by address so that
+ * neighbouring runs can be merged, and refilled from morecore in chunks
+ * of HEAP_CHUNK_PAGES.
+ */
+#define HEAP_MAGIC		0x68656170	/* "heap" */
+#define HEAP_MIN_SHIFT		4
+#define HEAP_MAX_SHIFT		(PAGE_SHIFT - 3)
+#define HEAP_NR_CLASSES		(HEAP_MAX_SHIFT - HEAP_MIN_SHIFT + 1)
+#define HEAP_LARGE		HEAP_NR_CLASSES
+#define HEAP_CHUNK_PAGES	16
+
+struct heap_page {
+	u32 magic;
+	u32 class;
+	/* slab pages */
+	void *free_obj;
+	unsigned long nr_used;
+	struct heap_page *next, *prev;
+	/* large allocations */
+	void *run;
+	unsigned long npages;
+};
+
+struct heap_run {
+	unsigned long npages;
+	struct heap_run *next;
+};
+
+static struct spinlock heap_lock;
+static struct heap_page *heap_partial[HEAP_NR_CLASSES];
+static struct heap_run *heap_free_runs;
+static void *(*heap_morecore)(unsigned long npages);
+
+static void *phys_morecore(unsigned long npages)
+{
+	phys_addr_t addr = phys_alloc_aligned_safe(npages * PAGE_SIZE,
+						   PAGE_SIZE, true);
+	if (addr == INVALID_PHYS_ADDR)
+		return NULL;
+
+	return phys_to_virt(addr);
+}
+
+static void heap_run_free(void *mem, unsigned long npages)
+{
+	struct heap_run *run = mem, **pp = &heap_free_runs, *prev = NULL;
+
+	while (*pp && (void *)*pp < mem) {
+		prev = *pp;
+		pp = &(*pp)->next;
+	}
+
+	run->npages = npages;
+	run->next = *pp;
+	*pp = run;
+
+	if (run->next && (void *)run + npages * PAGE_SIZE == run->next) {
+		run->npages += run->next->npages;
+		run->next = run->next->next;
+	}
+	if (prev && (void *)prev + prev->npages * PAGE_SIZE == run) {
+		prev->npages += run->npages;
+		prev->next = run->next;
+	}
+}
+
+static void *heap_run_alloc(unsigned long npages)
+{
+	struct heap_run **pp, *run;
+	unsigned long chunk;
+	void *mem;
+
+	for (;;) {
+		for (pp = &heap_free_runs; *pp; pp = &(*pp)->next) {
+			run = *pp;
+			if (run->npages < npages)
+				continue;
+			if (run->npages == npages) {
+				*pp = run->next;
+				return run;
+			}
+			/* hand out the tail, the head stays on the list */
+			run->npages -= npages;
+			return (void *)run + run->npages * PAGE_SIZE;
+		}
+
+		chunk = HEAP_CHUNK_PAGES;
+		while (chunk < npages)
+			chunk <<= 1;
+		mem = heap_morecore(chunk);
+		if (!mem)
+			return NULL;
+		heap_run_free(mem, chunk);
+	}
+}
+
+static void heap_partial_add(struct heap_page *page)
+{
+	page->prev = NULL;
+	page->next = heap_partial[page->class];
+	if (page->next)
+		page->next->prev = page;
+	heap_partial[page->class] = page;
+}
+
+static void heap_partial_del(struct heap_page *page)
+{
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		heap_partial[page->class] = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+}
+
+static void *heap_slab_alloc(int class)
+{
+	unsigned long size = 1ul << (class + HEAP_MIN_SHIFT), off;
+	struct heap_page *page = heap_partial[class];
+	void *obj;
+
+	if (!page) {
+		page = heap_run_alloc(1);
+		if (!page)
+			return NULL;
+		page->magic = HEAP_MAGIC;
+		page->class = class;
+		page->nr_used = 0;
+		page->free_obj = NULL;
+		for (off = PAGE_SIZE - size;
+		     off >= ALIGN(sizeof(*page), size); off -= size) {
+			obj = (void *)page + off;
+			*(void **)obj = page->free_obj;
+			page->free_obj = obj;
+		}
+		heap_partial_add(page);
+	}
+
+	obj = page->free_obj;
+	page->free_obj = *(void **)obj;
+	page->nr_used++;
+	if (!page->free_obj)
+		heap_partial_del(page);
+	return obj;
+}
+
+static void heap_slab_free(struct heap_page *page, void *obj)
+{
+	if (!page->free_obj)
+		heap_partial_add(page);
+	*(void **)obj = page->free_obj;
+	page->free_obj = obj;
+
+	if (--page->nr_used == 0) {
+		heap_partial_del(page);
+		page->magic = 0;
+		heap_run_free(page, 1);
+	}
+}
+
+static void *heap_large_alloc(size_t size, size_t align)
+{
+	struct heap_page *page;
+	unsigned long npages;
+	void *run, *ptr;
+
+	if (align <= PAGE_SIZE) {
+		npages = DIV_ROUND_UP(ALIGN(sizeof(*page), align) + size,
+				      PAGE_SIZE);
+		run = heap_run_alloc(npages);
+		if (!run)
+			return NULL;
+		page = run;
+		ptr = run + ALIGN(sizeof(*page), align);
+	} else {
+		npages = align / PAGE_SIZE + DIV_ROUND_UP(size, PAGE_SIZE);
+		run = heap_run_alloc(npages);
+		if (!run)
+			return NULL;
+		ptr = (void *)ALIGN((unsigned long)run + PAGE_SIZE, align);
+		page = ptr - PAGE_SIZE;
+	}
+
+	page->magic = HEAP_MAGIC;
+	page->class = HEAP_LARGE;
+	page->run = run;
+	page->npages = npages;
+	return ptr;
+}
+
+static int heap_class(size_t size)
+{
+	int class = 0;
+
+	while ((1ul << (class + HEAP_MIN_SHIFT)) < size)
+		++class;
+	return class;
+}
+
+static void *heap_memalign(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	assert(alignment && !(alignment & (alignment - 1)));
+
+	spin_lock(&heap_lock);
+	if (size <= (1ul << HEAP_MAX_SHIFT) &&
+	    alignment <= (1ul << HEAP_MAX_SHIFT))
+		ptr = heap_slab_alloc(heap_class(MAX(size, alignment)));
+	else
+		ptr = heap_large_alloc(size, alignment);
+	spin_unlock(&heap_lock);
+
+	return ptr;
+}
+
+static void *heap_malloc(size_t size)
+{
+	/* align_min is 0 when phys_alloc was never initialized, e.g. x86 */
+	return heap_memalign(MAX(align_min, sizeof(long)), size);
+}
+
+static void *heap_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ptr = heap_malloc(nmemb * size);
+	if (ptr)
+		memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+static void heap_free(void *ptr)
+{
+	struct heap_page *page;
+
+	if (!ptr)
+		return;
+
+	page = (void *)(((unsigned long)ptr - 1) & PAGE_MASK);
+
+	spin_lock(&heap_lock);
+	/* memory handed out by early_alloc_ops can't be freed */
+	if (page->magic == HEAP_MAGIC) {
+		if (page->class == HEAP_LARGE) {
+			page->magic = 0;
+			heap_run_free(page->run, page->npages);
+		} else {
+			heap_slab_free(page, ptr);
+		}
+	}
+	spin_unlock(&heap_lock);
+}
+
+static struct alloc_ops heap_alloc_ops = {
+	.malloc = heap_malloc,
+	.calloc = heap_calloc,
+	.free = heap_free,
+	.memalign = heap_memalign,
+};
+
+void heap_init(void *(*morecore)(unsigned long npages))
+{
+	heap_morecore = morecore ? morecore : phys_morecore;
+	alloc_ops = &heap_alloc_ops;
+}
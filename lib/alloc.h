@@ -34,6 +34,16 @@ struct alloc_ops {
  */
 extern struct alloc_ops *alloc_ops;
 
+/*
+ * heap_init switches alloc_ops to heap_alloc_ops, a general purpose
+ * allocator which, unlike the early_* functions, reuses freed memory.
+ * Small requests are served from per size class slab pages, larger ones
+ * from runs of whole pages. The pages come from @morecore, which must
+ * return @npages (always a power of two) contiguous, page aligned pages,
+ * or NULL. If @morecore is NULL, pages are taken from phys_alloc.
+ */
+extern void heap_init(void *(*morecore)(unsigned long npages));
+
 static inline void *malloc(size_t size)
 {
 	assert(alloc_ops && alloc_ops->malloc);
@@ -83,6 +93,14 @@ extern void phys_alloc_init(phys_addr_t base, phys_addr_t size);
  */
 extern void phys_alloc_set_minimum_alignment(phys_addr_t align);
 
+/*
+ * phys_alloc_set_cpu_id enables per-cpu magazines. Once @cpu_id, which
+ * returns the calling cpu's index, is set, small allocations are served
+ * from a chunk of memory owned by the calling cpu without taking the
+ * global lock. cpus without an index below 64 keep using the lock.
+ */
+extern void phys_alloc_set_cpu_id(int (*cpu_id)(void));
+
 /*
  * phys_alloc_aligned returns the base address of a region of size @size,
  * where the address is aligned to @align, or INVALID_PHYS_ADDR if there
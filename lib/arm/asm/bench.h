@@ -0,0 +1,38 @@
+#ifndef _ASMARM_BENCH_H_
+#define _ASMARM_BENCH_H_
+/*
+ * The virtual counter (CNTVCT) is readable at PL0/PL1 without any setup
+ * and keeps ticking across vCPU migrations, unlike PMCCNTR, which needs
+ * the PMU and may trap.  Its resolution is coarser, which bench_run()
+ * makes up for by batching calls.
+ */
+#include <libcflat.h>
+#include <asm/barrier.h>
+#include <asm/setup.h>
+#include <asm/smp.h>
+
+static inline u64 bench_cycles(void)
+{
+	u64 t;
+
+	isb();
+	asm volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r" (t));
+	isb();
+	return t;
+}
+
+static inline u64 arch_bench_hz(void)
+{
+	u32 frq;
+
+	asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (frq));
+	return frq;
+}
+
+/* bench_run_cpus() needs the secondaries to be in do_idle() */
+#define BENCH_HAVE_SMP
+#define BENCH_NR_CPUS			NR_CPUS
+#define bench_smp_id()			smp_processor_id()
+#define bench_on_cpu_async(cpu, fn, data) on_cpu_async(cpu, fn, data)
+
+#endif
@@ -30,6 +30,9 @@ extern phys_addr_t __phys_offset, __phys_end;
 #define PHYS_IO_OFFSET		(0UL)
 #define PHYS_IO_END		(1UL << 30)
 
+/* the pl011 used for the console, see lib/arm/io.c */
+extern volatile u8 *uart0_base;
+
 #define L1_CACHE_SHIFT		6
 #define L1_CACHE_BYTES		(1 << L1_CACHE_SHIFT)
 #define SMP_CACHE_BYTES		L1_CACHE_BYTES
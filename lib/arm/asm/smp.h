@@ -46,4 +46,17 @@ extern struct secondary_data secondary_data;
 
 extern void smp_boot_secondary(int cpu, secondary_entry_fn entry);
 
+/*
+ * A CPU booted at do_idle() runs the functions queued for it with
+ * on_cpu_async(), one at a time.  On the calling CPU itself they run
+ * right away.  on_cpu() also waits for the function to return, and
+ * on_cpus() runs it on every online CPU at the same time, the caller
+ * included, and waits for all of them.
+ */
+extern void do_idle(void);
+extern bool cpu_is_idle(int cpu);
+extern void on_cpu_async(int cpu, void (*func)(void *data), void *data);
+extern void on_cpu(int cpu, void (*func)(void *data), void *data);
+extern void on_cpus(void (*func)(void *data), void *data);
+
 #endif /* _ASMARM_SMP_H_ */
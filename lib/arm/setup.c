@@ -53,6 +53,11 @@ static void cpu_init(void)
 	set_cpu_online(0, true);
 }
 
+static int cpu_id(void)
+{
+	return smp_processor_id();
+}
+
 static void mem_init(phys_addr_t freemem_start)
 {
 	struct dt_pbus_reg regs[NR_MEM_REGIONS];
@@ -96,6 +101,7 @@ static void mem_init(phys_addr_t freemem_start)
 
 	phys_alloc_init(freemem_start, primary.end - freemem_start);
 	phys_alloc_set_minimum_alignment(SMP_CACHE_BYTES);
+	heap_init(NULL);
 
 	mmu_enable_idmap();
 }
@@ -121,6 +127,7 @@ void setup(const void *fdt)
 	cpu_init();
 
 	thread_info_init(current_thread_info(), 0);
+	phys_alloc_set_cpu_id(cpu_id);
 
 	ret = dt_get_bootargs(&bootargs);
 	assert(ret == 0);
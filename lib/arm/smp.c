@@ -11,6 +11,7 @@
 #include <asm/barrier.h>
 #include <asm/mmu.h>
 #include <asm/psci.h>
+#include <asm/setup.h>
 #include <asm/smp.h>
 
 cpumask_t cpu_present_mask;
@@ -53,3 +54,75 @@ void smp_boot_secondary(int cpu, secondary_entry_fn entry)
 	while (!cpu_online(cpu))
 		wfe();
 }
+
+/*
+ * smp_boot_secondary() can start a CPU only once, so a CPU started at
+ * do_idle() waits there for the functions given to on_cpu_async().
+ */
+struct cpu_work {
+	void (*func)(void *data);
+	void *data;
+	volatile bool pending;
+};
+
+static struct cpu_work cpu_work[NR_CPUS];
+
+void do_idle(void)
+{
+	struct cpu_work *w = &cpu_work[smp_processor_id()];
+
+	for (;;) {
+		while (!w->pending)
+			wfe();
+		smp_rmb();
+		w->func(w->data);
+		smp_mb();
+		w->pending = false;
+		sev();
+	}
+}
+
+bool cpu_is_idle(int cpu)
+{
+	return !cpu_work[cpu].pending;
+}
+
+void on_cpu_async(int cpu, void (*func)(void *data), void *data)
+{
+	struct cpu_work *w = &cpu_work[cpu];
+
+	if (cpu == smp_processor_id()) {
+		func(data);
+		return;
+	}
+
+	while (w->pending)
+		wfe();
+	w->func = func;
+	w->data = data;
+	smp_mb();
+	w->pending = true;
+	sev();
+}
+
+void on_cpu(int cpu, void (*func)(void *data), void *data)
+{
+	on_cpu_async(cpu, func, data);
+	while (!cpu_is_idle(cpu))
+		wfe();
+	smp_rmb();
+}
+
+void on_cpus(void (*func)(void *data), void *data)
+{
+	int cpu, me = smp_processor_id();
+
+	for_each_online_cpu(cpu)
+		if (cpu != me)
+			on_cpu_async(cpu, func, data);
+	func(data);
+	for_each_online_cpu(cpu)
+		while (!cpu_is_idle(cpu))
+			wfe();
+	smp_rmb();
+}
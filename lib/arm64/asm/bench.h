@@ -0,0 +1,35 @@
+#ifndef _ASMARM64_BENCH_H_
+#define _ASMARM64_BENCH_H_
+/*
+ * The virtual counter (CNTVCT_EL0), see lib/arm/asm/bench.h.
+ */
+#include <libcflat.h>
+#include <asm/barrier.h>
+#include <asm/setup.h>
+#include <asm/smp.h>
+
+static inline u64 bench_cycles(void)
+{
+	u64 t;
+
+	isb();
+	asm volatile("mrs %0, cntvct_el0" : "=r" (t));
+	isb();
+	return t;
+}
+
+static inline u64 arch_bench_hz(void)
+{
+	u64 frq;
+
+	asm volatile("mrs %0, cntfrq_el0" : "=r" (frq));
+	return frq;
+}
+
+/* bench_run_cpus() needs the secondaries to be in do_idle() */
+#define BENCH_HAVE_SMP
+#define BENCH_NR_CPUS			NR_CPUS
+#define bench_smp_id()			smp_processor_id()
+#define bench_on_cpu_async(cpu, fn, data) on_cpu_async(cpu, fn, data)
+
+#endif
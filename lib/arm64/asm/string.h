@@ -0,0 +1,5 @@
+#ifndef _ASMARM64_STRING_H_
+#define _ASMARM64_STRING_H_
+
+#include <asm-generic/string.h>
+#endif
@@ -0,0 +1,12 @@
+#ifndef _ASM_GENERIC_STRING_H_
+#define _ASM_GENERIC_STRING_H_
+/*
+ * asm-generic/string.h
+ *
+ * An architecture that provides its own memset(), memcpy(), ... defines
+ * __HAVE_ARCH_MEMSET, __HAVE_ARCH_MEMCPY, ... in its asm/string.h, and
+ * lib/string.c leaves the word-at-a-time versions out.  Without any of
+ * them, this header is all asm/string.h needs to include.
+ */
+
+#endif
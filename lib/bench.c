@@ -0,0 +1,176 @@
+/*
+ * Microbenchmark helpers, see bench.h.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include "bench.h"
+
+static u64 hz;
+
+u64 bench_hz(void)
+{
+	if (!hz)
+		hz = arch_bench_hz();
+	return hz;
+}
+
+static u64 time_batch(struct bench *b, u64 iters)
+{
+	u64 t0, t1, i;
+
+	t0 = bench_cycles();
+	for (i = 0; i < iters; ++i)
+		b->func(b->data);
+	t1 = bench_cycles();
+	return t1 - t0;
+}
+
+static void sort(u64 *v, int n)
+{
+	int i, j;
+	u64 x;
+
+	for (i = 1; i < n; ++i) {
+		x = v[i];
+		for (j = i; j > 0 && v[j - 1] > x; --j)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+}
+
+void bench_summarize(u64 *samples, int nr_samples, u64 iters,
+		     struct bench_result *r)
+{
+	u64 q1, q3, fence, sum = 0;
+	int n;
+
+	sort(samples, nr_samples);
+
+	q1 = samples[nr_samples / 4];
+	q3 = samples[nr_samples * 3 / 4];
+	fence = q3 + 3 * (q3 - q1);
+	for (n = 0; n < nr_samples && samples[n] <= fence; ++n)
+		sum += samples[n];
+
+	r->cpu = bench_smp_id();
+	r->iters = iters;
+	r->samples = n;
+	r->rejected = nr_samples - n;
+	r->min = samples[0] * 100 / iters;
+	r->median = samples[(n - 1) / 2] * 100 / iters;
+	r->mean = sum * 100 / n / iters;
+	r->max = samples[n - 1] * 100 / iters;
+}
+
+void bench_run(struct bench *b, struct bench_result *r)
+{
+	u64 samples[BENCH_SAMPLES], goal, iters;
+	int i;
+
+	/* at least 1000 ticks, so coarse counters still give 0.1% */
+	goal = bench_hz() / (1000000 / BENCH_SAMPLE_US);
+	if (goal < 1000)
+		goal = 1000;
+	for (iters = 1; time_batch(b, iters) < goal; iters *= 2)
+		;
+
+	for (i = 0; i < BENCH_SAMPLES; ++i)
+		samples[i] = time_batch(b, iters);
+	bench_summarize(samples, BENCH_SAMPLES, iters, r);
+}
+
+/*
+ * Append " key=v" with two decimals to the string in buf, cut off at
+ * size - 1 characters.  The end is found with strlen() rather than from
+ * snprintf()'s return value, which counts the NUL in lib/printf.c and
+ * is past the end of buf when the output did not fit.
+ */
+static void print_fixed(char *buf, int size, const char *key, u64 v)
+{
+	int n = strlen(buf);
+
+	snprintf(buf + n, size - n, " %s=%" PRIu64 ".%02" PRIu64,
+		 key, v / 100, v % 100);
+}
+
+void bench_print(struct bench *b, struct bench_result *r)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "BENCH: name=%s cpu=%d iters=%" PRIu64
+		 " samples=%d/%d", b->name, r->cpu, r->iters, r->samples,
+		 r->samples + r->rejected);
+	print_fixed(buf, sizeof(buf), "ticks", r->median);
+	print_fixed(buf, sizeof(buf), "min", r->min);
+	print_fixed(buf, sizeof(buf), "mean", r->mean);
+	print_fixed(buf, sizeof(buf), "max", r->max);
+	/* 1/100 ns, scaled so that nothing overflows 64 bits */
+	print_fixed(buf, sizeof(buf), "ns",
+		    r->median * 1000000 / (bench_hz() / 1000));
+	printf("%s hz=%" PRIu64 "\n", buf, bench_hz());
+}
+
+static void bench_measure(struct bench *b, struct bench_result *r)
+{
+	if (b->measure)
+		b->measure(b, r);
+	else
+		bench_run(b, r);
+}
+
+void bench_one(struct bench *b)
+{
+	struct bench_result r;
+
+	bench_measure(b, &r);
+	bench_print(b, &r);
+}
+
+#ifdef BENCH_HAVE_SMP
+struct bench_cpus {
+	struct bench *b;
+	int ncpus;
+	volatile int nr_ready, nr_done;
+};
+
+/*
+ * What one CPU runs: its result goes to the slot it was given rather
+ * than one picked by CPU ID, which need not be dense.
+ */
+struct bench_slot {
+	struct bench_cpus *c;
+	struct bench_result *r;
+};
+
+static void bench_cpu(void *data)
+{
+	struct bench_slot *s = data;
+	struct bench_cpus *c = s->c;
+
+	__sync_fetch_and_add(&c->nr_ready, 1);
+	while (c->nr_ready < c->ncpus)
+		;
+	bench_measure(c->b, s->r);
+	__sync_fetch_and_add(&c->nr_done, 1);
+}
+
+void bench_run_cpus(struct bench *b, struct bench_result *results, int ncpus)
+{
+	static struct bench_slot slots[BENCH_NR_CPUS];
+	struct bench_cpus c = { b, ncpus, 0, 0 };
+	int cpu;
+
+	assert(ncpus <= BENCH_NR_CPUS);
+	bench_hz();
+	for (cpu = 0; cpu < ncpus; ++cpu) {
+		slots[cpu].c = &c;
+		slots[cpu].r = &results[cpu];
+	}
+	/* CPU 0 runs its share synchronously, so queue it last */
+	for (cpu = ncpus - 1; cpu >= 0; --cpu)
+		bench_on_cpu_async(cpu, bench_cpu, &slots[cpu]);
+	while (c.nr_done < ncpus)
+		;
+}
+#endif
@@ -0,0 +1,72 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+/*
+ * Microbenchmark helpers shared by all architectures.
+ *
+ * bench_run() calls b->func(b->data) in batches timed with the
+ * architecture's cycle counter, bench_cycles() from asm/bench.h.  It
+ * doubles the batch size until a batch lasts BENCH_SAMPLE_US, which also
+ * warms up caches and TLBs, then times BENCH_SAMPLES batches and drops
+ * those above the upper Tukey fence, Q3 + 3 * (Q3 - Q1): that is where
+ * interrupts and host preemption end up.
+ *
+ * bench_print() reports a result as one line, which run_tests.sh
+ * collects into bench.log:
+ *
+ *   BENCH: name=<name> cpu=<cpu> iters=<calls per batch>
+ *          samples=<kept>/<taken> ticks=<median> min=<min> mean=<mean>
+ *          max=<max> ns=<median> hz=<counter frequency>
+ *
+ * Values are per call, in counter ticks except for ns, with two decimals.
+ */
+#include <libcflat.h>
+#include <asm/bench.h>
+
+#define BENCH_SAMPLES	32
+#define BENCH_SAMPLE_US	100
+
+struct bench_result {
+	int cpu;
+	u64 iters;
+	int samples;
+	int rejected;
+	/* per call, in 1/100 counter ticks */
+	u64 min, median, mean, max;
+};
+
+struct bench {
+	const char *name;
+	void (*func)(void *data);
+	void *data;
+	/*
+	 * If set, bench_one() and bench_run_cpus() call this instead of
+	 * bench_run(), for tests that bench_run() cannot time, e.g.
+	 * because each call needs its own setup.  It usually fills r
+	 * with bench_summarize().
+	 */
+	void (*measure)(struct bench *b, struct bench_result *r);
+};
+
+/* Frequency of bench_cycles(), in Hz.  */
+extern u64 bench_hz(void);
+extern void bench_run(struct bench *b, struct bench_result *r);
+/*
+ * Fill r from nr_samples timings of iters calls each, as bench_run()
+ * does.  Sorts samples.  For the measure callback of struct bench.
+ */
+extern void bench_summarize(u64 *samples, int nr_samples, u64 iters,
+			    struct bench_result *r);
+extern void bench_print(struct bench *b, struct bench_result *r);
+/* bench_run(), or b->measure, and bench_print() on the current CPU.  */
+extern void bench_one(struct bench *b);
+
+#ifdef BENCH_HAVE_SMP
+/*
+ * Run b on CPUs 0 to ncpus - 1 at the same time, the i-th of them
+ * storing its result in results[i].  Must be called on CPU 0.
+ */
+extern void bench_run_cpus(struct bench *b, struct bench_result *results,
+			   int ncpus);
+#endif
+
+#endif /* _BENCH_H_ */
@@ -0,0 +1,99 @@
+/*
+ * Log-linear histograms, see hist.h.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include "hist.h"
+
+/* Middle of the range of values that land in bucket @i.  */
+static u64 hist_value(int i)
+{
+	int shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return ((u64)(HIST_SUB + i % HIST_SUB) << shift) + ((1ull << shift) >> 1);
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct hist *dst, struct hist *src)
+{
+	int i;
+
+	if (!src->nr)
+		return;
+	if (!dst->nr || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->sum += src->sum;
+	dst->nr += src->nr;
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		dst->bucket[i] += src->bucket[i];
+}
+
+u64 hist_percentile(struct hist *h, unsigned permyriad)
+{
+	u64 want = (h->nr * permyriad + 9999) / 10000, seen = 0, v;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	v = hist_value(i);
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+	return v;
+}
+
+static u64 isqrt(u64 n)
+{
+	u64 x = n, y = (n + 1) / 2;
+
+	while (y < x) {
+		x = y;
+		y = (x + n / x) / 2;
+	}
+	return x;
+}
+
+u64 hist_stddev(struct hist *h)
+{
+	u64 mean = h->sum / h->nr, var = 0, d, d2;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		if (!h->bucket[i])
+			continue;
+		d = hist_value(i);
+		d = d > mean ? d - mean : mean - d;
+		d2 = d * d;
+		var += d2 / h->nr * h->bucket[i] + d2 % h->nr * h->bucket[i] / h->nr;
+	}
+	return isqrt(var);
+}
+
+void hist_print(const char *name, struct hist *h)
+{
+	if (!h->nr) {
+		printf("%s samples=0\n", name);
+		return;
+	}
+	printf("%s samples=%" PRIu64 " min=%" PRIu64 " p50=%" PRIu64
+	       " p90=%" PRIu64 " p99=%" PRIu64 " p99.9=%" PRIu64
+	       " max=%" PRIu64 " mean=%" PRIu64 " stddev=%" PRIu64 "\n",
+	       name, h->nr, h->min, hist_percentile(h, 5000),
+	       hist_percentile(h, 9000), hist_percentile(h, 9900),
+	       hist_percentile(h, 9990), h->max, h->sum / h->nr,
+	       hist_stddev(h));
+}
@@ -0,0 +1,60 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+/*
+ * Log-linear histogram of u64 samples, e.g. latencies in cycles.
+ *
+ * Values below HIST_SUB get one bucket each; above that every power of
+ * two is split into HIST_SUB linear sub-buckets, so a bucket is never
+ * wider than 1/HIST_SUB of its lower bound.  Percentiles and the
+ * standard deviation are computed from bucket midpoints.
+ *
+ * A zeroed struct hist is empty, so static ones need no hist_reset().
+ * hist_print() reports a histogram as one line:
+ *
+ *   <name> samples=<n> min=<min> p50=<p50> p90=<p90> p99=<p99>
+ *          p99.9=<p99.9> max=<max> mean=<mean> stddev=<stddev>
+ */
+#include <libcflat.h>
+
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	u64 nr;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u32 bucket[HIST_BUCKETS];
+};
+
+static inline int hist_index(u64 v)
+{
+	int shift;
+
+	if (v < HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Inline, as it is called from timed loops and interrupt handlers.  */
+static inline void hist_add(struct hist *h, u64 v)
+{
+	if (!h->nr || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+	h->nr++;
+	h->bucket[hist_index(v)]++;
+}
+
+extern void hist_reset(struct hist *h);
+extern void hist_merge(struct hist *dst, struct hist *src);
+/* Value at or below which @permyriad/10000 of the samples fall.  */
+extern u64 hist_percentile(struct hist *h, unsigned permyriad);
+extern u64 hist_stddev(struct hist *h);
+extern void hist_print(const char *name, struct hist *h);
+
+#endif /* _HIST_H_ */
@@ -33,6 +33,7 @@
 #define __ALIGN_MASK(x, mask)	(((x) + (mask)) & ~(mask))
 #define __ALIGN(x, a)		__ALIGN_MASK(x, (typeof(x))(a) - 1)
 #define ALIGN(x, a)		__ALIGN((x), (a))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
 
 typedef uint8_t		u8;
 typedef int8_t		s8;
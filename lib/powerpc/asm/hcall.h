@@ -23,6 +23,10 @@
 #define H_RANDOM		0x300
 #define H_SET_MODE		0x31C
 
+/* H_PAGE_INIT flags */
+#define H_ZERO_PAGE		(1UL << (63-48))
+#define H_COPY_PAGE		(1UL << (63-49))
+
 #ifndef __ASSEMBLY__
 /*
  * hcall_have_broken_sc1 checks if we're on a host with a broken sc1.
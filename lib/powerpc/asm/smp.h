@@ -1,6 +1,10 @@
 #ifndef _ASMPOWERPC_SMP_H_
 #define _ASMPOWERPC_SMP_H_
 
+/* Each secondary stack, of which the top half is for exceptions */
+#define SECONDARY_STACK_SIZE	(64*1024)
+
+#ifndef __ASSEMBLY__
 #include <libcflat.h>
 
 extern int nr_threads;
@@ -19,4 +23,37 @@ extern struct start_threads start_cpu(int cpu_node, secondary_entry_fn entry,
 				      uint32_t r3);
 extern bool start_all_cpus(secondary_entry_fn entry, uint32_t r3);
 
+/*
+ * secondary_entry is the entry point to pass to start_all_cpus() for
+ * threads that should run C code: each thread gets its own stack and
+ * exception stack and a number for smp_processor_id(), then calls the
+ * function set with secondary_set_entry().
+ */
+extern void secondary_entry(void);
+extern void secondary_set_entry(secondary_entry_fn entry);
+
+/*
+ * With do_idle() as the secondary_set_entry() function, a thread runs
+ * the functions queued for it with on_cpu_async(), one at a time.  On
+ * the calling thread itself they run right away.  on_cpu() also waits
+ * for the function to return, and on_cpus() runs it on all nr_threads
+ * threads at the same time, the caller included, and waits for all of
+ * them.
+ */
+extern void do_idle(void);
+extern bool cpu_is_idle(int cpu);
+extern void on_cpu_async(int cpu, void (*func)(void *data), void *data);
+extern void on_cpu(int cpu, void (*func)(void *data), void *data);
+extern void on_cpus(void (*func)(void *data), void *data);
+
+/* 0 for the boot thread, 1 to nr_threads - 1 in the order they start */
+static inline int smp_processor_id(void)
+{
+	int cpu;
+
+	asm volatile ("mfsprg2 %0" : "=r" (cpu));
+	return cpu;
+}
+#endif /* !__ASSEMBLY__ */
+
 #endif /* _ASMPOWERPC_SMP_H_ */
@@ -96,6 +96,9 @@ static void cpu_init(void)
 	__dcache_bytes = params.dcache_bytes;
 	tb_hz = params.tb_hz;
 
+	/* smp_processor_id() of the boot thread */
+	asm volatile ("mtsprg2 %0" : : "r" (0));
+
 	/* Interrupt Endianness */
 
 #if  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -149,6 +152,7 @@ static void mem_init(phys_addr_t freemem_start)
 	phys_alloc_init(freemem_start, primary.end - freemem_start);
 	phys_alloc_set_minimum_alignment(__icache_bytes > __dcache_bytes
 					 ? __icache_bytes : __dcache_bytes);
+	heap_init(NULL);
 }
 
 void setup(const void *fdt)
@@ -10,9 +10,17 @@
 #include <asm/setup.h>
 #include <asm/rtas.h>
 #include <asm/smp.h>
+#include <asm/barrier.h>
 
 int nr_threads;
 
+static char secondary_stacks[NR_CPUS][SECONDARY_STACK_SIZE]
+	__attribute__((aligned(16)));
+/* secondary_entry takes stacks from the top down */
+unsigned long secondary_stack_top =
+	(unsigned long)secondary_stacks + sizeof(secondary_stacks);
+static secondary_entry_fn secondary_c_entry;
+
 struct secondary_entry_data {
 	secondary_entry_fn entry;
 	uint64_t r3;
@@ -101,3 +109,93 @@ bool start_all_cpus(secondary_entry_fn entry, uint32_t r3)
 	/* We expect that we come in with one thread already started */
 	return data.nr_started == nr_threads - 1;
 }
+
+void secondary_set_entry(secondary_entry_fn entry)
+{
+	secondary_c_entry = entry;
+}
+
+/*
+ * Called by secondary_entry with the top of the stack it took, which
+ * gives the thread its number.
+ */
+void secondary_cinit(unsigned long stack_top)
+{
+	unsigned long cpu = ((unsigned long)secondary_stacks
+			     + sizeof(secondary_stacks) - stack_top)
+			    / SECONDARY_STACK_SIZE + 1;
+
+	assert(cpu < NR_CPUS && secondary_c_entry);
+	asm volatile ("mtsprg2 %0" : : "r" (cpu));
+	secondary_c_entry();
+}
+
+/*
+ * Threads started at do_idle() wait there for the functions given to
+ * on_cpu_async().
+ */
+struct cpu_work {
+	void (*func)(void *data);
+	void *data;
+	volatile bool pending;
+};
+
+static struct cpu_work cpu_work[NR_CPUS];
+
+void do_idle(void)
+{
+	struct cpu_work *w = &cpu_work[smp_processor_id()];
+
+	for (;;) {
+		while (!w->pending)
+			cpu_relax();
+		smp_rmb();
+		w->func(w->data);
+		smp_mb();
+		w->pending = false;
+	}
+}
+
+bool cpu_is_idle(int cpu)
+{
+	return !cpu_work[cpu].pending;
+}
+
+void on_cpu_async(int cpu, void (*func)(void *data), void *data)
+{
+	struct cpu_work *w = &cpu_work[cpu];
+
+	if (cpu == smp_processor_id()) {
+		func(data);
+		return;
+	}
+
+	while (w->pending)
+		cpu_relax();
+	w->func = func;
+	w->data = data;
+	smp_mb();
+	w->pending = true;
+}
+
+void on_cpu(int cpu, void (*func)(void *data), void *data)
+{
+	on_cpu_async(cpu, func, data);
+	while (!cpu_is_idle(cpu))
+		cpu_relax();
+	smp_rmb();
+}
+
+void on_cpus(void (*func)(void *data), void *data)
+{
+	int cpu, me = smp_processor_id();
+
+	for (cpu = 0; cpu < nr_threads; ++cpu)
+		if (cpu != me)
+			on_cpu_async(cpu, func, data);
+	func(data);
+	for (cpu = 0; cpu < nr_threads; ++cpu)
+		while (!cpu_is_idle(cpu))
+			cpu_relax();
+	smp_rmb();
+}
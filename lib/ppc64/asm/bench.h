@@ -0,0 +1,32 @@
+#ifndef _ASMPPC64_BENCH_H_
+#define _ASMPPC64_BENCH_H_
+/*
+ * The timebase, at the frequency the device tree gives for it.
+ */
+#include <libcflat.h>
+#include <asm/processor.h>
+#include <asm/setup.h>
+#include <asm/smp.h>
+
+static inline u64 bench_cycles(void)
+{
+	u64 t;
+
+	asm volatile("isync" : : : "memory");
+	t = get_tb();
+	asm volatile("isync" : : : "memory");
+	return t;
+}
+
+static inline u64 arch_bench_hz(void)
+{
+	return tb_hz;
+}
+
+/* bench_run_cpus() needs the secondaries to be in do_idle() */
+#define BENCH_HAVE_SMP
+#define BENCH_NR_CPUS			NR_CPUS
+#define bench_smp_id()			smp_processor_id()
+#define bench_on_cpu_async(cpu, fn, data) on_cpu_async(cpu, fn, data)
+
+#endif
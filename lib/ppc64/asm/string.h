@@ -0,0 +1,5 @@
+#ifndef _ASMPPC64_STRING_H_
+#define _ASMPPC64_STRING_H_
+
+#include <asm-generic/string.h>
+#endif
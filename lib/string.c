@@ -1,12 +1,38 @@
 #include "libcflat.h"
+#include "asm/string.h"
+
+/*
+ * The generic versions below work a word at a time once the pointers
+ * are word aligned; an architecture can replace some of them with its
+ * own by defining __HAVE_ARCH_<NAME> in asm/string.h.
+ */
+typedef unsigned long __attribute__((__may_alias__)) word_t;
+
+#define WORD_SIZE	sizeof(word_t)
+#define WORD_ONES	((word_t)-1 / 0xff)
+#define WORD_HIGHS	(WORD_ONES * 0x80)
+/* nonzero iff some byte of w is zero */
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+static inline bool word_aligned(const void *p)
+{
+    return !((unsigned long)p & (WORD_SIZE - 1));
+}
 
 unsigned long strlen(const char *buf)
 {
-    unsigned long len = 0;
-
-    while (*buf++)
-	++len;
-    return len;
+    const char *p = buf;
+    const word_t *w;
+
+    for (; !word_aligned(p); ++p)
+	if (!*p)
+	    return p - buf;
+    /* aligned loads never cross a page, so reading past the end is fine */
+    for (w = (const word_t *)p; !WORD_HAS_ZERO(*w); ++w)
+	;
+    for (p = (const char *)w; *p; ++p)
+	;
+    return p - buf;
 }
 
 char *strcat(char *dest, const char *src)
@@ -48,51 +74,78 @@ char *strchr(const char *s, int c)
     return (char *)s;
 }
 
+/*
+ * Only positions that start with the needle's first character are
+ * compared, and the haystack is never measured up front: the search
+ * stops as soon as a comparison runs into its end.
+ */
 char *strstr(const char *s1, const char *s2)
 {
-    size_t l1, l2;
+    size_t i;
 
-    l2 = strlen(s2);
-    if (!l2)
+    if (!*s2)
 	return (char *)s1;
-    l1 = strlen(s1);
-    while (l1 >= l2) {
-	l1--;
-	if (!memcmp(s1, s2, l2))
+    for (; (s1 = strchr(s1, *s2)) != NULL; ++s1) {
+	for (i = 1; s2[i] && s1[i] == s2[i]; ++i)
+	    ;
+	if (!s2[i])
 	    return (char *)s1;
-	s1++;
+	if (!s1[i])
+	    break;
     }
     return NULL;
 }
 
+#ifndef __HAVE_ARCH_MEMSET
 void *memset(void *s, int c, size_t n)
 {
-    size_t i;
-    char *a = s;
+    unsigned char *a = s;
+    word_t w = (unsigned char)c * WORD_ONES;
 
-    for (i = 0; i < n; ++i)
-        a[i] = c;
+    for (; n && !word_aligned(a); --n)
+	*a++ = c;
+    for (; n >= WORD_SIZE; n -= WORD_SIZE, a += WORD_SIZE)
+	*(word_t *)a = w;
+    while (n--)
+	*a++ = c;
 
     return s;
 }
+#endif
 
+#ifndef __HAVE_ARCH_MEMCPY
 void *memcpy(void *dest, const void *src, size_t n)
 {
-    size_t i;
-    char *a = dest;
-    const char *b = src;
-
-    for (i = 0; i < n; ++i)
-        a[i] = b[i];
+    unsigned char *a = dest;
+    const unsigned char *b = src;
+
+    if (word_aligned((void *)((unsigned long)a ^ (unsigned long)b))) {
+	for (; n && !word_aligned(a); --n)
+	    *a++ = *b++;
+	for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+	    *(word_t *)a = *(const word_t *)b;
+	    a += WORD_SIZE, b += WORD_SIZE;
+	}
+    }
+    while (n--)
+	*a++ = *b++;
 
     return dest;
 }
+#endif
 
 int memcmp(const void *s1, const void *s2, size_t n)
 {
     const unsigned char *a = s1, *b = s2;
     int ret = 0;
 
+    /* skip equal words; the bytes of the first differing one decide */
+    if (word_aligned(a) && word_aligned(b)) {
+	while (n >= WORD_SIZE && *(const word_t *)a == *(const word_t *)b) {
+	    a += WORD_SIZE, b += WORD_SIZE;
+	    n -= WORD_SIZE;
+	}
+    }
     while (n--) {
 	ret = *a - *b;
 	if (ret)
@@ -1,5 +1,7 @@
 #include "libcflat.h"
 #include "acpi.h"
+#include "processor.h"
+#include "asm/io.h"
 
 void* find_acpi_table_addr(u32 sig)
 {
@@ -50,3 +52,29 @@ void* find_acpi_table_addr(u32 sig)
     }
    return NULL;
 }
+
+/*
+ * Count TSC ticks across ~10ms of the 3.579545 MHz ACPI PM timer.  The
+ * result is cached, so only the first call takes that long.
+ */
+u64 calibrate_tsc(void)
+{
+    static u64 tsc_hz;
+    struct fadt_descriptor_rev1 *fadt;
+    const u32 pm_hz = 3579545, mask = 0xffffff;
+    u32 pm_start, pm_now;
+    u64 t1, t2;
+
+    if (tsc_hz)
+        return tsc_hz;
+
+    fadt = find_acpi_table_addr(FACP_SIGNATURE);
+    pm_start = inl(fadt->pm_tmr_blk) & mask;
+    t1 = rdtsc();
+    do {
+        pm_now = inl(fadt->pm_tmr_blk) & mask;
+    } while (((pm_now - pm_start) & mask) < pm_hz / 100);
+    t2 = rdtsc();
+    tsc_hz = (t2 - t1) * pm_hz / ((pm_now - pm_start) & mask);
+    return tsc_hz;
+}
@@ -100,5 +100,6 @@ struct facs_descriptor_rev1
 };
 
 void* find_acpi_table_addr(u32 sig);
+u64 calibrate_tsc(void);
 
 #endif
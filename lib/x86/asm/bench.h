@@ -0,0 +1,34 @@
+#ifndef _ASM_X86_BENCH_H_
+#define _ASM_X86_BENCH_H_
+
+#include "libcflat.h"
+#include "x86/processor.h"
+#include "x86/smp.h"
+#include "x86/acpi.h"
+
+/*
+ * The TSC, read with lfence on both sides so that neither earlier nor
+ * later instructions leak into the measured interval.
+ */
+static inline u64 bench_cycles(void)
+{
+	u64 t;
+
+	asm volatile ("lfence" : : : "memory");
+	t = rdtsc();
+	asm volatile ("lfence" : : : "memory");
+	return t;
+}
+
+static inline u64 arch_bench_hz(void)
+{
+	return calibrate_tsc();
+}
+
+#define BENCH_HAVE_SMP
+#define BENCH_NR_CPUS			NR_CPUS
+#define bench_smp_id()			smp_id()
+#define bench_cpu_count()		cpu_count()
+#define bench_on_cpu_async(cpu, fn, data) on_cpu_async(cpu, fn, data)
+
+#endif
@@ -18,6 +18,7 @@
 
 #ifdef __x86_64__
 #define LARGE_PAGE_SIZE	(512 * PAGE_SIZE)
+#define HUGE_PAGE_SIZE	(512 * LARGE_PAGE_SIZE)
 #else
 #define LARGE_PAGE_SIZE	(1024 * PAGE_SIZE)
 #endif
@@ -0,0 +1,9 @@
+#ifndef _ASM_X86_STRING_H_
+#define _ASM_X86_STRING_H_
+
+/* rep stos/movs, in lib/x86/string.c */
+#define __HAVE_ARCH_MEMSET
+#define __HAVE_ARCH_MEMCPY
+
+#include <asm-generic/string.h>
+#endif
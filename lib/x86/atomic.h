@@ -161,4 +161,24 @@ u64 atomic64_cmpxchg(atomic64_t *v, u64 old, u64 new);
 
 #endif
 
+/**
+ * atomic_cmpxchg - compare and exchange atomic variable
+ * @v: pointer of type atomic_t
+ * @old: expected value
+ * @new: value to store if @v is @old
+ *
+ * Atomically stores @new in @v if it contained @old and returns the
+ * value @v had before the operation.
+ */
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	int ret;
+
+	asm volatile("lock cmpxchgl %2, %1"
+		     : "=a" (ret), "+m" (v->counter)
+		     : "r" (new), "0" (old)
+		     : "memory");
+	return ret;
+}
+
 #endif
@@ -0,0 +1,22 @@
+#ifndef __CONSOLE_H
+#define __CONSOLE_H
+
+#include "libcflat.h"
+
+/*
+ * By default every puts() goes straight to the console device.  While
+ * buffered, output stays in a per-CPU buffer until it fills up or is
+ * flushed, so that printing does not cause exits in the middle of a
+ * measurement.  exit() flushes every CPU's buffer.
+ */
+void console_set_buffered(bool buffered);
+void console_flush(void);
+void console_flush_all(void);
+
+/*
+ * Called before main() to take the console's own arguments, currently
+ * just "debugcon", out of argv.
+ */
+void console_setup_args(void);
+
+#endif
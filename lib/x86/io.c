@@ -3,23 +3,66 @@
 #include "smp.h"
 #include "asm/io.h"
 #include "asm/page.h"
+#include "console.h"
 #ifndef USE_SERIAL
 #define USE_SERIAL
 #endif
 
+/*
+ * Output goes to the serial port, FIFO-sized chunks at a time.  With
+ * "debugcon" on the command line, and an isa-debugcon device at
+ * DEBUGCON_PORT, it goes there instead, since a whole string then takes
+ * a single rep outsb.  x86/run then passes -debugcon stdio instead of
+ * -serial stdio, so run_tests.sh still sees the results.
+ */
+#define DEBUGCON_PORT	0xe9
+#define SERIAL_FIFO	16
+
+#define CONSOLE_BUF_SIZE 1024
+
+/*
+ * Each CPU stages its output in its own buffer, so that only the
+ * flush to the device is serialized.  The per-buffer lock only guards
+ * against CPUs that share a buffer, i.e. APIC IDs beyond NR_CPUS.
+ */
+struct console_buf {
+	struct spinlock lock;
+	unsigned long len;
+	char buf[CONSOLE_BUF_SIZE];
+} __attribute__((aligned(64)));
+
 static struct spinlock lock;
+static struct console_buf console_bufs[NR_CPUS];
+static bool console_buffered;
 static int serial_iobase = 0x3f8;
-static int serial_inited = 0;
+static int serial_burst = 1;
+static int console_inited = 0;
+static bool want_debugcon, use_debugcon;
+
+extern int __argc;
+extern char *__argv[];
+
+static void outsb(int port, const char *buf, unsigned long len)
+{
+        asm volatile ("rep/outsb" : "+S"(buf), "+c"(len) : "d"(port));
+}
 
-static void serial_outb(char ch)
+static void serial_write(const char *buf, unsigned long len)
 {
+        unsigned long n;
         u8 lsr;
 
-        do {
-                lsr = inb(serial_iobase + 0x05);
-        } while (!(lsr & 0x20));
+        while (len) {
+                do {
+                        lsr = inb(serial_iobase + 0x05);
+                } while (!(lsr & 0x20));
 
-        outb(ch, serial_iobase + 0x00);
+                /* THRE means the whole transmit FIFO is empty */
+                n = len < serial_burst ? len : serial_burst;
+                outsb(serial_iobase + 0x00, buf, n);
+                buf += n;
+                len -= n;
+        }
 }
 
 static void serial_init(void)
@@ -39,35 +82,113 @@ static void serial_init(void)
         lcr = inb(serial_iobase + 0x03);
         lcr &= ~0x80;
         outb(lcr, serial_iobase + 0x03);
+
+        /* enable and clear the FIFOs; a 16550A reports them in IIR */
+        outb(0x07, serial_iobase + 0x02);
+        if ((inb(serial_iobase + 0x02) & 0xc0) == 0xc0)
+                serial_burst = SERIAL_FIFO;
 }
 
-static void print_serial(const char *buf)
+void console_setup_args(void)
 {
-	unsigned long len = strlen(buf);
-#ifdef USE_SERIAL
-        unsigned long i;
-        if (!serial_inited) {
-            serial_init();
-            serial_inited = 1;
+        int i, j;
+
+        for (i = j = 1; i < __argc; ++i) {
+                if (strcmp(__argv[i], "debugcon") == 0)
+                        want_debugcon = true;
+                else
+                        __argv[j++] = __argv[i];
         }
+        __argc = j;
+}
 
-        for (i = 0; i < len; i++) {
-            serial_outb(buf[i]);
+static void console_init(void)
+{
+        /* the debugcon reads back as its port number */
+        use_debugcon = want_debugcon && inb(DEBUGCON_PORT) == DEBUGCON_PORT;
+        if (!use_debugcon)
+                serial_init();
+}
+
+static void console_write(const char *buf, unsigned long len)
+{
+	spin_lock(&lock);
+#ifdef USE_SERIAL
+        if (!console_inited) {
+            console_init();
+            console_inited = 1;
         }
+
+        if (use_debugcon)
+                outsb(DEBUGCON_PORT, buf, len);
+        else
+                serial_write(buf, len);
 #else
-        asm volatile ("rep/outsb" : "+S"(buf), "+c"(len) : "d"(0xf1));
+        outsb(0xf1, buf, len);
 #endif
+	spin_unlock(&lock);
+}
+
+static void console_buf_flush(struct console_buf *cb)
+{
+	if (cb->len) {
+		console_write(cb->buf, cb->len);
+		cb->len = 0;
+	}
+}
+
+static struct console_buf *this_console_buf(void)
+{
+	return &console_bufs[(unsigned)smp_id() % NR_CPUS];
 }
 
 void puts(const char *s)
 {
-	spin_lock(&lock);
-	print_serial(s);
-	spin_unlock(&lock);
+	struct console_buf *cb = this_console_buf();
+	unsigned long len = strlen(s);
+
+	spin_lock(&cb->lock);
+	if (cb->len + len > CONSOLE_BUF_SIZE)
+		console_buf_flush(cb);
+	if (!console_buffered || len > CONSOLE_BUF_SIZE) {
+		console_write(s, len);
+	} else {
+		memcpy(cb->buf + cb->len, s, len);
+		cb->len += len;
+	}
+	spin_unlock(&cb->lock);
+}
+
+void console_set_buffered(bool buffered)
+{
+	console_buffered = buffered;
+	if (!buffered)
+		console_flush_all();
+}
+
+void console_flush(void)
+{
+	struct console_buf *cb = this_console_buf();
+
+	spin_lock(&cb->lock);
+	console_buf_flush(cb);
+	spin_unlock(&cb->lock);
+}
+
+void console_flush_all(void)
+{
+	int i;
+
+	for (i = 0; i < NR_CPUS; i++) {
+		spin_lock(&console_bufs[i].lock);
+		console_buf_flush(&console_bufs[i]);
+		spin_unlock(&console_bufs[i].lock);
+	}
 }
 
 void exit(int code)
 {
+        console_flush_all();
 #ifdef USE_SERIAL
         static const char shutdown_str[8] = "Shutdown";
         int i;
@@ -4,32 +4,71 @@
 #include "apic.h"
 #include "fwcfg.h"
 #include "desc.h"
+#include "processor.h"
+#include "atomic.h"
 
 #define IPI_VECTOR 0x20
+#define IPI_RING_SIZE 16
 
 typedef void (*ipi_function_type)(void *data);
 
-static struct spinlock ipi_lock;
-static volatile ipi_function_type ipi_function;
-static void *volatile ipi_data;
-static volatile int ipi_done;
-static volatile bool ipi_wait;
+struct ipi_call {
+    atomic_t seq;
+    ipi_function_type function;
+    void *data;
+    atomic_t *done;
+};
+
+/*
+ * Every CPU has a bounded ring of pending calls that any CPU can add to
+ * without taking a lock.  Slot i of the ring is free for position pos
+ * when its sequence number equals pos, and holds a call for the owner
+ * to run once the sequence number is pos + 1.  The owner hands the slot
+ * back by moving its sequence number to pos + IPI_RING_SIZE.
+ */
+struct ipi_mailbox {
+    atomic_t head;
+    volatile unsigned tail;
+    struct ipi_call ring[IPI_RING_SIZE];
+} __attribute__((aligned(64)));
+
+static struct ipi_mailbox ipi_mailbox[NR_CPUS];
+static volatile bool smp_ids_ready;
 static int _cpu_count;
 
 static __attribute__((used)) void ipi()
 {
-    void (*function)(void *data) = ipi_function;
-    void *data = ipi_data;
-    bool wait = ipi_wait;
+    struct ipi_mailbox *mb;
+    struct ipi_call *call;
+    ipi_function_type function;
+    void *data;
+    atomic_t *done;
+    unsigned pos;
+
+    /* %gs:0 is only valid once smp_init() has run setup_smp_id() here. */
+    mb = &ipi_mailbox[smp_ids_ready ? smp_id() : apic_id()];
+
+    /*
+     * Acknowledge first: a call queued from now on raises a new
+     * interrupt, so nothing can be left behind in the ring.
+     */
+    apic_write(APIC_EOI, 0);
+
+    for (;;) {
+	pos = mb->tail;
+	call = &mb->ring[pos % IPI_RING_SIZE];
+	if ((unsigned)atomic_read(&call->seq) != pos + 1)
+	    break;
+	function = call->function;
+	data = call->data;
+	done = call->done;
+	barrier();
+	atomic_set(&call->seq, pos + IPI_RING_SIZE);
+	mb->tail = pos + 1;
 
-    if (!wait) {
-	ipi_done = 1;
-	apic_write(APIC_EOI, 0);
-    }
-    function(data);
-    if (wait) {
-	ipi_done = 1;
-	apic_write(APIC_EOI, 0);
+	function(data);
+	if (done)
+	    atomic_inc(done);
     }
 }
 
@@ -43,6 +82,51 @@ asm (
 #endif
      );
 
+static void ipi_queue(int cpu, ipi_function_type function, void *data,
+		      atomic_t *done)
+{
+    struct ipi_mailbox *mb = &ipi_mailbox[cpu];
+    struct ipi_call *call;
+    unsigned pos;
+
+    for (;;) {
+	pos = atomic_read(&mb->head);
+	call = &mb->ring[pos % IPI_RING_SIZE];
+	if ((unsigned)atomic_read(&call->seq) == pos) {
+	    if ((unsigned)atomic_cmpxchg(&mb->head, pos, pos + 1) == pos)
+		break;
+	} else {
+	    /* ring is full, wait for the target to drain it */
+	    pause();
+	}
+    }
+
+    call->function = function;
+    call->data = data;
+    call->done = done;
+    barrier();
+    atomic_set(&call->seq, pos + 1);
+
+    apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED
+		   | IPI_VECTOR, cpu);
+}
+
+/*
+ * Mailboxes are indexed by APIC ID, which can be sparse and go beyond
+ * cpu_count(), so set up all of them.
+ */
+static void ipi_mailbox_init(void)
+{
+    int cpu, i;
+
+    for (cpu = 0; cpu < NR_CPUS; ++cpu) {
+	atomic_set(&ipi_mailbox[cpu].head, 0);
+	ipi_mailbox[cpu].tail = 0;
+	for (i = 0; i < IPI_RING_SIZE; ++i)
+	    atomic_set(&ipi_mailbox[cpu].ring[i].seq, i);
+    }
+}
+
 void spin_lock(struct spinlock *lock)
 {
     int v = 1;
@@ -77,36 +161,51 @@ static void setup_smp_id(void *data)
     asm ("mov %0, %%gs:0" : : "r"(apic_id()) : "memory");
 }
 
-static void __on_cpu(int cpu, void (*function)(void *data), void *data,
-                     int wait)
+void on_cpu(int cpu, void (*function)(void *data), void *data)
 {
-    spin_lock(&ipi_lock);
-    if (cpu == smp_id())
+    atomic_t done;
+
+    if (cpu == smp_id()) {
 	function(data);
-    else {
-	ipi_done = 0;
-	ipi_function = function;
-	ipi_data = data;
-	ipi_wait = wait;
-	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED
-                       | IPI_VECTOR,
-                       cpu);
-	while (!ipi_done)
-	    ;
+	return;
     }
-    spin_unlock(&ipi_lock);
-}
 
-void on_cpu(int cpu, void (*function)(void *data), void *data)
-{
-    __on_cpu(cpu, function, data, 1);
+    atomic_set(&done, 0);
+    ipi_queue(cpu, function, data, &done);
+    while (!atomic_read(&done))
+	pause();
 }
 
 void on_cpu_async(int cpu, void (*function)(void *data), void *data)
 {
-    __on_cpu(cpu, function, data, 0);
+    if (cpu == smp_id())
+	function(data);
+    else
+	ipi_queue(cpu, function, data, NULL);
 }
 
+/*
+ * Run @function on every CPU in @mask, including the calling one, and
+ * return once all of them have finished.
+ */
+void on_cpus_mask(const cpumask_t *mask, void (*function)(void *data),
+		  void *data)
+{
+    atomic_t done;
+    int cpu, me = smp_id(), nr = 0;
+
+    atomic_set(&done, 0);
+    for (cpu = 0; cpu < cpu_count(); ++cpu) {
+	if (cpu == me || !cpumask_test_cpu(cpu, mask))
+	    continue;
+	ipi_queue(cpu, function, data, &done);
+	++nr;
+    }
+    if (cpumask_test_cpu(me, mask))
+	function(data);
+    while (atomic_read(&done) < nr)
+	pause();
+}
 
 void smp_init(void)
 {
@@ -114,6 +213,10 @@ void smp_init(void)
     void ipi_entry(void);
 
     _cpu_count = fwcfg_get_nb_cpus();
+    assert(_cpu_count <= NR_CPUS);
+
+    smp_ids_ready = false;
+    ipi_mailbox_init();
 
     setup_idt();
     set_idt_entry(IPI_VECTOR, ipi_entry, 0);
@@ -121,5 +224,5 @@ void smp_init(void)
     setup_smp_id(0);
     for (i = 1; i < cpu_count(); ++i)
         on_cpu(i, setup_smp_id, 0);
-
+    smp_ids_ready = true;
 }
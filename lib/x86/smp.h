@@ -1,6 +1,36 @@
 #ifndef __SMP_H
 #define __SMP_H
 #include <asm/spinlock.h>
+#include <bitops.h>
+
+#define NR_CPUS 256
+
+typedef struct cpumask {
+	unsigned long bits[NR_CPUS / BITS_PER_LONG];
+} cpumask_t;
+
+static inline void cpumask_clear(cpumask_t *mask)
+{
+	int i;
+
+	for (i = 0; i < NR_CPUS / BITS_PER_LONG; ++i)
+		mask->bits[i] = 0;
+}
+
+static inline void cpumask_set_cpu(int cpu, cpumask_t *mask)
+{
+	mask->bits[BIT_WORD(cpu)] |= BIT_MASK(cpu);
+}
+
+static inline void cpumask_clear_cpu(int cpu, cpumask_t *mask)
+{
+	mask->bits[BIT_WORD(cpu)] &= ~BIT_MASK(cpu);
+}
+
+static inline int cpumask_test_cpu(int cpu, const cpumask_t *mask)
+{
+	return !!(mask->bits[BIT_WORD(cpu)] & BIT_MASK(cpu));
+}
 
 void smp_init(void);
 
@@ -8,5 +38,7 @@ int cpu_count(void);
 int smp_id(void);
 void on_cpu(int cpu, void (*function)(void *data), void *data);
 void on_cpu_async(int cpu, void (*function)(void *data), void *data);
+void on_cpus_mask(const cpumask_t *mask, void (*function)(void *data),
+		  void *data);
 
 #endif
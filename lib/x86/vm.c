@@ -1,41 +1,199 @@
 #include "fwcfg.h"
 #include "vm.h"
 #include "libcflat.h"
+#include "smp.h"
+#include "alloc.h"
 
-static void *free = 0;
 static void *vfree_top = 0;
 
+/*
+ * Physical pages are managed by a buddy allocator.  Free blocks of 2^order
+ * pages are kept on one doubly linked list per order, threaded through
+ * the first page of each block, and page_order[pfn] is order + 1 when pfn
+ * is the first page of a free block (0 otherwise).  Only the first page of
+ * every block is touched when memory is handed to the allocator, so
+ * setup_vm() does not have to walk all of guest RAM.
+ *
+ * On top of that every CPU keeps a small cache of single pages, refilled
+ * from and flushed to the buddy lists in batches, so that alloc_page()
+ * and free_page() normally do not take the global lock.
+ */
+#define MAX_ORDER	19	/* up to 2^18 pages, i.e. 1G blocks */
+#define PCP_HIGH	32
+#define PCP_BATCH	16
+
+struct free_block {
+    struct free_block *next, *prev;
+};
+
+static struct free_block *free_area[MAX_ORDER];
+static u8 *page_order;
+static unsigned long max_pfn;
+static struct spinlock buddy_lock;
+
+struct page_cache {
+    int nr;
+    void *pages[PCP_HIGH];
+} __attribute__((aligned(64)));
+
+static struct page_cache page_cache[NR_CPUS];
+
+static void free_area_add(struct free_block *b, int order)
+{
+    b->prev = NULL;
+    b->next = free_area[order];
+    if (b->next)
+	b->next->prev = b;
+    free_area[order] = b;
+    page_order[virt_to_phys(b) >> PAGE_SHIFT] = order + 1;
+}
+
+static void free_area_del(struct free_block *b, int order)
+{
+    if (b->prev)
+	b->prev->next = b->next;
+    else
+	free_area[order] = b->next;
+    if (b->next)
+	b->next->prev = b->prev;
+    page_order[virt_to_phys(b) >> PAGE_SHIFT] = 0;
+}
+
+static void __free_pages(unsigned long pfn, int order)
+{
+    unsigned long buddy;
+
+    while (order < MAX_ORDER - 1) {
+	buddy = pfn ^ (1ul << order);
+	if (buddy >= max_pfn || page_order[buddy] != order + 1)
+	    break;
+	free_area_del(phys_to_virt(buddy << PAGE_SHIFT), order);
+	pfn &= ~(1ul << order);
+	++order;
+    }
+    free_area_add(phys_to_virt(pfn << PAGE_SHIFT), order);
+}
+
+static void *__alloc_pages(int order)
+{
+    struct free_block *b;
+    unsigned long pfn;
+    int o;
+
+    for (o = order; o < MAX_ORDER && !free_area[o]; ++o)
+	;
+    if (o == MAX_ORDER)
+	return NULL;
+
+    b = free_area[o];
+    free_area_del(b, o);
+    pfn = virt_to_phys(b) >> PAGE_SHIFT;
+    while (o > order) {
+	--o;
+	free_area_add(phys_to_virt((pfn + (1ul << o)) << PAGE_SHIFT), o);
+    }
+    return b;
+}
+
 static void free_memory(void *mem, unsigned long size)
 {
-    while (size >= PAGE_SIZE) {
-	*(void **)mem = free;
-	free = mem;
-	mem += PAGE_SIZE;
-	size -= PAGE_SIZE;
+    unsigned long pfn = (virt_to_phys(mem) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    unsigned long end = (virt_to_phys(mem) + size) >> PAGE_SHIFT;
+    int order;
+
+    spin_lock(&buddy_lock);
+    while (pfn < end) {
+	for (order = MAX_ORDER - 1; order; --order)
+	    if (!(pfn & ((1ul << order) - 1)) && pfn + (1ul << order) <= end)
+		break;
+	__free_pages(pfn, order);
+	pfn += 1ul << order;
     }
+    spin_unlock(&buddy_lock);
 }
 
-void *alloc_page()
+static struct page_cache *this_page_cache(void)
 {
+    int cpu = smp_id();
+
+    return cpu < NR_CPUS ? &page_cache[cpu] : NULL;
+}
+
+static void page_cache_drain(struct page_cache *pc, int nr)
+{
+    spin_lock(&buddy_lock);
+    while (nr-- && pc->nr)
+	__free_pages(virt_to_phys(pc->pages[--pc->nr]) >> PAGE_SHIFT, 0);
+    spin_unlock(&buddy_lock);
+}
+
+void *alloc_pages(int order)
+{
+    struct page_cache *pc = this_page_cache();
     void *p;
 
-    if (!free)
-	return 0;
+    assert(order >= 0 && order < MAX_ORDER);
 
-    p = free;
-    free = *(void **)free;
+    spin_lock(&buddy_lock);
+    p = __alloc_pages(order);
+    spin_unlock(&buddy_lock);
 
+    /* single pages may be parked in this CPU's cache */
+    if (!p && pc && pc->nr) {
+	page_cache_drain(pc, pc->nr);
+	spin_lock(&buddy_lock);
+	p = __alloc_pages(order);
+	spin_unlock(&buddy_lock);
+    }
     return p;
 }
 
+void free_pages(void *mem, int order)
+{
+    assert(order >= 0 && order < MAX_ORDER);
+    assert(!(virt_to_phys(mem) & ((PAGE_SIZE << order) - 1)));
+
+    spin_lock(&buddy_lock);
+    __free_pages(virt_to_phys(mem) >> PAGE_SHIFT, order);
+    spin_unlock(&buddy_lock);
+}
+
+void *alloc_page()
+{
+    struct page_cache *pc = this_page_cache();
+    void *p;
+
+    if (!pc)
+	return alloc_pages(0);
+
+    if (!pc->nr) {
+	spin_lock(&buddy_lock);
+	while (pc->nr < PCP_BATCH && (p = __alloc_pages(0)))
+	    pc->pages[pc->nr++] = p;
+	spin_unlock(&buddy_lock);
+	if (!pc->nr)
+	    return NULL;
+    }
+    return pc->pages[--pc->nr];
+}
+
 void free_page(void *page)
 {
-    *(void **)page = free;
-    free = page;
+    struct page_cache *pc = this_page_cache();
+
+    if (!pc) {
+	free_pages(page, 0);
+	return;
+    }
+
+    if (pc->nr == PCP_HIGH)
+	page_cache_drain(pc, PCP_BATCH);
+    pc->pages[pc->nr++] = page;
 }
 
 extern char edata;
 static unsigned long end_of_memory;
+static unsigned long max_page_size;
 
 unsigned long *install_pte(unsigned long *cr3,
 			   int pte_level,
@@ -76,7 +234,7 @@ unsigned long *get_pte(unsigned long *cr3, void *virt)
 	pte = pt[offset];
 	if (!(pte & PT_PRESENT_MASK))
 	    return NULL;
-	if (level == 2 && (pte & PT_PAGE_SIZE_MASK))
+	if (level <= 3 && (pte & PT_PAGE_SIZE_MASK))
 	    return &pt[offset];
 	pt = phys_to_virt(pte & PT_ADDR_MASK);
     }
@@ -100,13 +258,54 @@ unsigned long *install_page(unsigned long *cr3,
 }
 
 
+#ifdef __x86_64__
+unsigned long *install_huge_page(unsigned long *cr3,
+				 unsigned long phys,
+				 void *virt)
+{
+    return install_pte(cr3, 3, virt,
+		       phys | PT_PRESENT_MASK | PT_WRITABLE_MASK | PT_USER_MASK | PT_PAGE_SIZE_MASK, 0);
+}
+#endif
+
+void vm_set_max_page_size(unsigned long size)
+{
+	assert(!end_of_memory);
+#ifdef __x86_64__
+	assert(size == PAGE_SIZE || size == LARGE_PAGE_SIZE ||
+	       size == HUGE_PAGE_SIZE);
+#else
+	assert(size == PAGE_SIZE || size == LARGE_PAGE_SIZE);
+#endif
+	max_page_size = size;
+}
+
+unsigned long vm_max_page_size(void)
+{
+	return max_page_size;
+}
+
+/*
+ * The first gigabyte is never mapped with 1G pages: tests like smap and
+ * pku rewrite the identity map there one 4K/2M entry at a time.
+ */
 static void setup_mmu_range(unsigned long *cr3, unsigned long start,
 			    unsigned long len)
 {
 	u64 max = (u64)len + (u64)start;
 	u64 phys = start;
 
-	while (phys + LARGE_PAGE_SIZE <= max) {
+	while (max_page_size >= LARGE_PAGE_SIZE &&
+	       phys + LARGE_PAGE_SIZE <= max) {
+#ifdef __x86_64__
+		if (max_page_size == HUGE_PAGE_SIZE && phys >= HUGE_PAGE_SIZE &&
+		    !(phys & (HUGE_PAGE_SIZE - 1)) &&
+		    phys + HUGE_PAGE_SIZE <= max) {
+			install_huge_page(cr3, phys, (void *)(ulong)phys);
+			phys += HUGE_PAGE_SIZE;
+			continue;
+		}
+#endif
 		install_large_page(cr3, phys, (void *)(ulong)phys);
 		phys += LARGE_PAGE_SIZE;
 	}
@@ -122,6 +321,14 @@ static void setup_mmu(unsigned long len)
 
     memset(cr3, 0, PAGE_SIZE);
 
+    if (!max_page_size) {
+	max_page_size = LARGE_PAGE_SIZE;
+#ifdef __x86_64__
+	if (cpuid(0x80000001).d & (1 << 26))	/* PDPE1GB */
+	    max_page_size = HUGE_PAGE_SIZE;
+#endif
+    }
+
 #ifdef __x86_64__
     if (len < (1ul << 32))
         len = (1ul << 32);  /* map mmio 1:1 */
@@ -147,14 +354,35 @@ static void setup_mmu(unsigned long len)
     printf("cr0 = %lx\n", read_cr0());
     printf("cr3 = %lx\n", read_cr3());
     printf("cr4 = %lx\n", read_cr4());
+    printf("identity map page size = %ldK\n", max_page_size >> 10);
+}
+
+static void *vm_morecore(unsigned long npages)
+{
+    int order = 0;
+
+    while ((1ul << order) < npages)
+	++order;
+    return alloc_pages(order);
 }
 
 void setup_vm()
 {
+    unsigned long map_size;
+
     assert(!end_of_memory);
     end_of_memory = fwcfg_get_u64(FW_CFG_RAM_SIZE);
-    free_memory(&edata, end_of_memory - (unsigned long)&edata);
+
+    /* the page_order[] map sits right after the image */
+    max_pfn = end_of_memory >> PAGE_SHIFT;
+    page_order = (u8 *)ALIGN((unsigned long)&edata, PAGE_SIZE);
+    map_size = ALIGN(max_pfn, PAGE_SIZE);
+    memset(page_order, 0, map_size);
+
+    free_memory((void *)page_order + map_size,
+		end_of_memory - ((unsigned long)page_order + map_size));
     setup_mmu(end_of_memory);
+    heap_init(vm_morecore);
 }
 
 void *vmalloc(unsigned long size)
@@ -7,6 +7,15 @@
 
 void setup_vm();
 
+/*
+ * The identity map built by setup_vm() uses pages of at most @size bytes
+ * (PAGE_SIZE, LARGE_PAGE_SIZE or, on x86_64, HUGE_PAGE_SIZE).  Must be
+ * called before setup_vm(); by default the largest size the CPU supports
+ * is used.  vm_max_page_size() returns the size in effect.
+ */
+void vm_set_max_page_size(unsigned long size);
+unsigned long vm_max_page_size(void);
+
 void *vmalloc(unsigned long size);
 void vfree(void *mem);
 void *vmap(unsigned long long phys, unsigned long size);
@@ -23,9 +32,15 @@ unsigned long *install_pte(unsigned long *cr3,
 
 void *alloc_page();
 void free_page(void *page);
+void *alloc_pages(int order);
+void free_pages(void *mem, int order);
 
 unsigned long *install_large_page(unsigned long *cr3,unsigned long phys,
                                   void *virt);
 unsigned long *install_page(unsigned long *cr3, unsigned long phys, void *virt);
+#ifdef __x86_64__
+unsigned long *install_huge_page(unsigned long *cr3, unsigned long phys,
+                                 void *virt);
+#endif
 
 #endif
@@ -12,9 +12,6 @@
 
 #define PAGE_SIZE 4096
 
-#define H_ZERO_PAGE	(1UL << (63-48))
-#define H_COPY_PAGE	(1UL << (63-49))
-
 #define mfspr(nr) ({ \
 	uint64_t ret; \
 	asm volatile("mfspr %0,%1" : "=r"(ret) : "i"(nr)); \
@@ -0,0 +1,205 @@
+/*
+ * Time hypervisor round trips with the timebase: hcalls handled by KVM
+ * or QEMU, an RTAS call, the alignment interrupt taken by lswi/lswx in
+ * little endian mode, and how late a thread wakes up from H_CEDE.
+ *
+ * Usage: vmexit.elf [test...]
+ *
+ * Every test runs on all threads at the same time and prints one
+ * BENCH: line per thread, see lib/bench.h; the ticks are timebase
+ * ticks per operation.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include <bench.h>
+#include <asm/hcall.h>
+#include <asm/rtas.h>
+#include <asm/processor.h>
+#include <asm/handlers.h>
+#include <asm/setup.h>
+#include <asm/smp.h>
+
+#define PAGE_4K		4096
+
+#define MSR_EE		(1UL << 15)
+
+/* H_CEDE sleeps this long, in microseconds, before the decrementer */
+#define CEDE_US		100
+
+struct test {
+	const char *name;
+	void (*func)(void *data);
+	bool (*valid)(void);
+	/* run instead of bench_run(), see struct bench */
+	void (*measure)(struct bench *b, struct bench_result *r);
+};
+
+static int ncpus;
+static int rtas_tod_token;
+static u8 pages[NR_CPUS][2][PAGE_4K] __attribute__((aligned(PAGE_4K)));
+static char string_src[64];
+static volatile int alignments[NR_CPUS];
+
+/* H_SET_SPRG0 with the current value: handled by QEMU, no side effect.  */
+static void null_hcall(void *data __unused)
+{
+	unsigned long sprg0;
+
+	asm volatile ("mfsprg0 %0" : "=r" (sprg0));
+	hcall(H_SET_SPRG0, sprg0);
+}
+
+static void page_init_zero(void *data __unused)
+{
+	u8 *dst = pages[smp_processor_id()][0];
+
+	hcall(H_PAGE_INIT, H_ZERO_PAGE, dst, dst);
+}
+
+static void page_init_copy(void *data __unused)
+{
+	u8 *dst = pages[smp_processor_id()][0];
+	u8 *src = pages[smp_processor_id()][1];
+
+	hcall(H_PAGE_INIT, H_COPY_PAGE, dst, src);
+}
+
+static void h_random(void *data __unused)
+{
+	hcall(H_RANDOM);
+}
+
+static bool h_random_valid(void)
+{
+	return hcall(H_RANDOM) == H_SUCCESS;
+}
+
+static void alignment_handler(struct pt_regs *regs, void *data __unused)
+{
+	++alignments[smp_processor_id()];
+	regs->nip += 4;
+}
+
+static void lswi(void *data __unused)
+{
+	asm volatile ("lswi r11, %[addr], 8"
+		      : : [addr] "b" (string_src)
+		      : "r11", "r12", "memory");
+}
+
+static void lswx(void *data __unused)
+{
+	asm volatile ("mtxer %[len];"
+		      "lswx r11, 0, %[addr]"
+		      : : [len] "r" (8), [addr] "r" (string_src)
+		      : "r11", "r12", "xer", "memory");
+}
+
+/* Goes to QEMU through the H_RTAS hcall in the RTAS blob.  */
+static void rtas_get_time_of_day(void *data __unused)
+{
+	int now[8];
+
+	rtas_call(rtas_tod_token, 0, 8, now);
+}
+
+static bool rtas_valid(void)
+{
+	rtas_tod_token = rtas_token("get-time-of-day");
+	return rtas_tod_token != RTAS_UNKNOWN_SERVICE;
+}
+
+/*
+ * Arm the decrementer CEDE_US ahead and cede: each sample is how much
+ * later than that the thread got back, in timebase ticks.  H_CEDE sets
+ * MSR[EE] to take the decrementer interrupt, clear it again afterwards.
+ */
+static void h_cede_wakeup(struct bench *b __unused, struct bench_result *r)
+{
+	u64 samples[BENCH_SAMPLES], delta = tb_hz * CEDE_US / 1000000;
+	u64 t0, t1;
+	unsigned long msr;
+	int i;
+
+	for (i = 0; i < BENCH_SAMPLES; ++i) {
+		t0 = get_tb();
+		asm volatile ("mtdec %0" : : "r" (delta));
+		hcall(H_CEDE);
+		t1 = get_tb();
+		samples[i] = t1 - t0 > delta ? t1 - t0 - delta : 0;
+
+		asm volatile ("mfmsr %0" : "=r" (msr));
+		asm volatile ("mtmsrd %0, 1" : : "r" (msr & ~MSR_EE));
+	}
+	bench_summarize(samples, BENCH_SAMPLES, 1, r);
+}
+
+static struct test tests[] = {
+	{ .name = "null_hcall", .func = null_hcall },
+	{ .name = "h_page_init_zero", .func = page_init_zero },
+	{ .name = "h_page_init_copy", .func = page_init_copy },
+	{ .name = "h_random", .func = h_random, .valid = h_random_valid },
+	{ .name = "h_cede_wakeup", .measure = h_cede_wakeup },
+	{ .name = "lswi", .func = lswi },
+	{ .name = "lswx", .func = lswx },
+	{ .name = "rtas_get_time_of_day", .func = rtas_get_time_of_day,
+	  .valid = rtas_valid },
+};
+
+static void do_test(struct test *test)
+{
+	static struct bench_result results[NR_CPUS];
+	struct bench b = { test->name, test->func, NULL, test->measure };
+	int cpu, trapped = 0;
+
+	if (test->valid && !test->valid()) {
+		printf("%s (skipped)\n", test->name);
+		return;
+	}
+
+	memset((void *)alignments, 0, sizeof(alignments));
+	bench_run_cpus(&b, results, ncpus);
+
+	for (cpu = 0; cpu < ncpus; ++cpu) {
+		bench_print(&b, &results[cpu]);
+		trapped |= alignments[cpu];
+	}
+	if (trapped)
+		printf("%s: includes an alignment interrupt\n", test->name);
+}
+
+static bool test_wanted(struct test *test, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], test->name) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	handle_exception(0x600, alignment_handler, NULL);
+	handle_exception(0x900, dec_except_handler, NULL);
+
+	secondary_set_entry(do_idle);
+	if (!start_all_cpus(secondary_entry, 0))
+		report_abort("Failed to start secondary cpus");
+	ncpus = nr_threads;
+
+	printf("timebase %" PRIu64 " Hz, %d threads\n", tb_hz, ncpus);
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (test_wanted(&tests[i], argv + 1, argc - 1))
+			do_test(&tests[i]);
+
+	return report_summary();
+}
@@ -13,10 +13,12 @@ function usage()
 {
 cat <<EOF
 
-Usage: $0 [-g group] [-h] [-v]
+Usage: $0 [-g group] [-h] [-j N] [-v]
 
     -g: Only execute tests in the given group
     -h: Output this help text
+    -j: Execute up to N tests in parallel, as long as the smp values
+        of the running tests add up to at most MAX_SMP
     -v: Enables verbose mode
 
 Set the environment variable QEMU=/path/to/qemu-system-ARCH to
@@ -28,7 +30,7 @@ EOF
 RUNTIME_arch_run="./$TEST_DIR/run"
 source scripts/runtime.bash
 
-while getopts "g:hv" opt; do
+while getopts "g:hj:v" opt; do
     case $opt in
         g)
             only_group=$OPTARG
@@ -37,6 +39,13 @@ while getopts "g:hv" opt; do
             usage
             exit
             ;;
+        j)
+            jobs_max=$OPTARG
+            if ! [[ $jobs_max =~ ^[0-9]+$ ]] || [ $jobs_max -lt 1 ]; then
+                echo "Invalid -j $OPTARG"
+                exit 1
+            fi
+            ;;
         v)
             verbose="yes"
             ;;
@@ -46,17 +55,102 @@ while getopts "g:hv" opt; do
     esac
 done
 
-RUNTIME_log_stderr () { cat >> test.log; }
+test_log=test.log
+bench_log=bench.log
+
+RUNTIME_log_stderr () { cat >> $test_log; }
 RUNTIME_log_stdout () {
     if [ "$PRETTY_PRINT_STACKS" = "yes" ]; then
-        ./scripts/pretty_print_stacks.py $1 >> test.log
+        ./scripts/pretty_print_stacks.py $1
     else
-        cat >> test.log
+        cat
+    fi | tee >(RUNTIME_log_bench) >> $test_log
+}
+# BENCH: lines from lib/bench.c, tagged with the test that printed them
+RUNTIME_log_bench () {
+    grep '^BENCH: ' | sed "s/^BENCH: /BENCH: test=$testname /" >> $bench_log
+}
+
+# With -j, each test runs in the background and writes its console
+# output and logs to files numbered in config order; flush_jobs copies
+# those of finished tests out, in that order.
+declare -A job_smp
+jobs_started=0
+jobs_flushed=0
+
+function flush_jobs()
+{
+    local job
+
+    while [ -f $jobs_dir/$jobs_flushed.done ]; do
+        job=$jobs_dir/$jobs_flushed
+        cat $job.out
+        [ -f $job.log ] && cat $job.log >> test.log
+        [ -f $job.bench ] && cat $job.bench >> bench.log
+        ((jobs_flushed++))
+    done
+}
+
+# Number of running jobs in jobs_running and their smp total in smp_used
+function count_jobs()
+{
+    local pid
+
+    jobs_running=0
+    smp_used=0
+    for pid in $(jobs -rp); do
+        ((jobs_running++))
+        ((smp_used += ${job_smp[$pid]:-1}))
+    done
+}
+
+# Takes the same arguments as run, and starts it once there is room
+function run_job()
+{
+    local smp="$3"
+    local job=$jobs_dir/$jobs_started
+
+    if [ -z "$1" ]; then
+        return
     fi
+
+    # a test weighs its number of vcpus, e.g. 2 for "2,threads=2"
+    smp=$(eval echo "$smp")
+    smp=${smp%%[!0-9]*}
+    [ -z "$smp" ] || [ "$smp" -lt 1 ] && smp=1
+    [ "$smp" -gt "$MAX_SMP" ] && smp=$MAX_SMP
+
+    count_jobs
+    while [ $jobs_running -ge $jobs_max ] ||
+          [ $((smp_used + smp)) -gt $MAX_SMP ]; do
+        wait -n
+        flush_jobs
+        count_jobs
+    done
+
+    (
+        test_log=$job.log
+        bench_log=$job.bench
+        # run() does not wait for its loggers, which run in process
+        # substitutions.  They inherit fd 3, so cat only sees EOF, and
+        # the job only counts as done, once they have finished writing.
+        { run "$@" 3>&1 > $job.out; } | cat
+        touch $job.done
+    ) &
+    job_smp[$!]=$smp
+    ((jobs_started++))
 }
 
 
 config=$TEST_DIR/unittests.cfg
-rm -f test.log
+rm -f test.log bench.log
 printf "BUILD_HEAD=$(cat build-head)\n\n" > test.log
-for_each_unittest $config run
+if [ -z "$jobs_max" ]; then
+    for_each_unittest $config run
+else
+    jobs_dir=$(mktemp -d)
+    trap 'rm -rf "$jobs_dir"' EXIT
+    for_each_unittest $config run_job
+    wait
+    flush_jobs
+fi
@@ -0,0 +1,282 @@
+/*
+ * IPI storm benchmark: every CPU sends IPIs to every other CPU at the
+ * same time, using physical unicast, the all-but-self shorthand, and
+ * x2APIC cluster-mode logical destinations.
+ *
+ * Usage: ipi_storm.flat [rounds]
+ *
+ * For each mode the output has one summary line with the aggregate
+ * delivery rate, followed by one line per sender with the average
+ * send-to-handler latency, in TSC cycles, towards each destination.
+ */
+#include "libcflat.h"
+#include "smp.h"
+#include "apic.h"
+#include "processor.h"
+#include "atomic.h"
+#include "isr.h"
+#include "msr.h"
+#include "x86/vm.h"
+#include "x86/acpi.h"
+#include "x86/console.h"
+
+#define STORM_VECTOR	0x40
+
+enum storm_mode {
+	STORM_UNICAST,
+	STORM_BROADCAST,
+	STORM_LOGICAL,
+};
+
+static const char *mode_name[] = {
+	[STORM_UNICAST] = "unicast",
+	[STORM_BROADCAST] = "broadcast",
+	[STORM_LOGICAL] = "logical",
+};
+
+static int ncpus;
+static int rounds = 1000;
+static enum storm_mode mode;
+static u32 logical_id[NR_CPUS];
+static u64 tsc_hz;
+
+/*
+ * ping[dst][src] holds the TSC at which src sent an IPI to dst, or 0 once
+ * dst has handled it.  A sender waits for its cell to clear before it
+ * sends to the same destination again.
+ */
+static volatile u64 ping[NR_CPUS][NR_CPUS];
+static u64 lat_sum[NR_CPUS][NR_CPUS];
+static u32 lat_nr[NR_CPUS][NR_CPUS];
+static u64 nr_received[NR_CPUS];
+static u64 nr_sent[NR_CPUS];
+static u64 cpu_start[NR_CPUS], cpu_end[NR_CPUS];
+static atomic_t nr_ready, nr_finished, nr_drained;
+
+static void storm_isr(isr_regs_t *regs)
+{
+	int me = smp_id(), src;
+	u64 sent, now;
+
+	if (me >= ncpus) {
+		/* reached by the all-but-self shorthand only */
+		apic_write(APIC_EOI, 0);
+		return;
+	}
+
+	for (src = 0; src < ncpus; ++src) {
+		sent = ping[me][src];
+		if (!sent)
+			continue;
+		/*
+		 * Read the TSC after the stamp, which may have been posted
+		 * after this handler started.  Skip the sample if the TSCs
+		 * of the two CPUs are still out of step.
+		 */
+		rmb();
+		now = rdtsc();
+		if (now >= sent) {
+			lat_sum[src][me] += now - sent;
+			lat_nr[src][me]++;
+		}
+		nr_received[me]++;
+		ping[me][src] = 0;
+	}
+	apic_write(APIC_EOI, 0);
+}
+
+static void post(int dst, int me)
+{
+	while (ping[dst][me])
+		pause();
+	ping[dst][me] = rdtsc();
+}
+
+static void send_unicast(int me)
+{
+	int dst;
+
+	for (dst = 0; dst < ncpus; ++dst) {
+		if (dst == me)
+			continue;
+		post(dst, me);
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL |
+			       APIC_DM_FIXED | STORM_VECTOR, dst);
+		nr_sent[me]++;
+	}
+}
+
+static void send_broadcast(int me)
+{
+	int dst;
+
+	for (dst = 0; dst < ncpus; ++dst)
+		if (dst != me)
+			post(dst, me);
+	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_ALLBUT |
+		       APIC_DM_FIXED | STORM_VECTOR, 0);
+	nr_sent[me]++;
+}
+
+/*
+ * In x2APIC mode the logical ID is the cluster number in bits 31:16 and
+ * a one-hot position within the cluster in bits 15:0, so one ICR write
+ * reaches every selected CPU of a cluster.
+ */
+static void send_logical(int me)
+{
+	u32 cluster, dest;
+	int dst, first;
+
+	for (first = 0; first < ncpus; first = dst) {
+		cluster = logical_id[first] >> 16;
+		dest = 0;
+		for (dst = first; dst < ncpus &&
+		     logical_id[dst] >> 16 == cluster; ++dst) {
+			if (dst == me)
+				continue;
+			post(dst, me);
+			dest |= logical_id[dst];
+		}
+		if (!(dest & 0xffff))
+			continue;
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_LOGICAL |
+			       APIC_DM_FIXED | STORM_VECTOR, dest);
+		nr_sent[me]++;
+	}
+}
+
+static void storm(void *data)
+{
+	int me = smp_id(), i;
+
+	if (me >= ncpus)
+		return;
+
+	irq_enable();
+	atomic_inc(&nr_ready);
+	while (atomic_read(&nr_ready) < ncpus)
+		pause();
+
+	cpu_start[me] = rdtsc();
+	for (i = 0; i < rounds; ++i) {
+		switch (mode) {
+		case STORM_UNICAST:
+			send_unicast(me);
+			break;
+		case STORM_BROADCAST:
+			send_broadcast(me);
+			break;
+		case STORM_LOGICAL:
+			send_logical(me);
+			break;
+		}
+	}
+	/* keep handling IPIs until every sender is done */
+	atomic_inc(&nr_finished);
+	while (atomic_read(&nr_finished) < ncpus)
+		pause();
+	for (i = 0; i < ncpus; ++i)
+		while (ping[i][me])
+			pause();
+	cpu_end[me] = rdtsc();
+
+	/* others may still be waiting for us to handle their last IPI */
+	atomic_inc(&nr_drained);
+	while (atomic_read(&nr_drained) < ncpus)
+		pause();
+	irq_disable();
+}
+
+static void read_logical_id(void *data)
+{
+	logical_id[smp_id()] = apic_read(APIC_LDR);
+}
+
+static bool x2apic_enabled(void)
+{
+	return rdmsr(MSR_IA32_APICBASE) & APIC_EXTD;
+}
+
+static void run_mode(enum storm_mode m)
+{
+	cpumask_t all;
+	u64 first = -1ull, last = 0, received = 0, sent = 0;
+	int src, dst;
+
+	memset(lat_sum, 0, sizeof(lat_sum));
+	memset(lat_nr, 0, sizeof(lat_nr));
+	memset(nr_received, 0, sizeof(nr_received));
+	memset(nr_sent, 0, sizeof(nr_sent));
+	atomic_set(&nr_ready, 0);
+	atomic_set(&nr_finished, 0);
+	atomic_set(&nr_drained, 0);
+	mode = m;
+
+	cpumask_clear(&all);
+	for (src = 0; src < ncpus; ++src)
+		cpumask_set_cpu(src, &all);
+	on_cpus_mask(&all, storm, NULL);
+
+	for (src = 0; src < ncpus; ++src) {
+		if (cpu_start[src] < first)
+			first = cpu_start[src];
+		if (cpu_end[src] > last)
+			last = cpu_end[src];
+		received += nr_received[src];
+		sent += nr_sent[src];
+	}
+
+	printf("ipi_storm mode=%s cpus=%d sent=%" PRIu64 " received=%" PRIu64
+	       " cycles=%" PRIu64 " ipis_per_sec=%" PRIu64 "\n",
+	       mode_name[m], ncpus, sent, received, last - first,
+	       received * (tsc_hz / 1000) / ((last - first) / 1000));
+
+	for (src = 0; src < ncpus; ++src) {
+		printf("latency mode=%s src=%d:", mode_name[m], src);
+		for (dst = 0; dst < ncpus; ++dst) {
+			if (lat_nr[src][dst])
+				printf(" %" PRIu64,
+				       lat_sum[src][dst] / lat_nr[src][dst]);
+			else
+				printf(" -");
+		}
+		printf("\n");
+	}
+}
+
+int main(int ac, char **av)
+{
+	int i;
+
+	setup_vm();
+	smp_init();
+
+	ncpus = cpu_count();
+	if (ncpus < 2) {
+		report_skip("ipi_storm needs at least 2 cpus");
+		return report_summary();
+	}
+	if (ac > 1)
+		rounds = atol(av[1]);
+
+	handle_irq(STORM_VECTOR, storm_isr);
+	tsc_hz = calibrate_tsc();
+	printf("tsc frequency %" PRIu64 " Hz, %d rounds\n", tsc_hz, rounds);
+
+	/* keep the results in the buffer while the next mode runs */
+	console_set_buffered(true);
+	run_mode(STORM_UNICAST);
+	run_mode(STORM_BROADCAST);
+
+	if (x2apic_enabled()) {
+		for (i = 0; i < ncpus; ++i)
+			on_cpu(i, read_logical_id, NULL);
+		run_mode(STORM_LOGICAL);
+	} else {
+		printf("ipi_storm mode=%s (skipped, no x2apic)\n",
+		       mode_name[STORM_LOGICAL]);
+	}
+
+	return report_summary();
+}
@@ -0,0 +1,118 @@
+/*
+ * malloc, calloc, memalign and free once setup_vm() has switched
+ * alloc_ops to the heap.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include "libcflat.h"
+#include "alloc.h"
+#include "vm.h"
+
+#define NR_OBJS		64
+
+static bool aligned(void *p, unsigned long align)
+{
+	return !((unsigned long)p & (align - 1));
+}
+
+static void test_sizes(void)
+{
+	static const size_t sizes[] = { 1, 8, 24, 100, 512, 4000, 5000, 65536 };
+	unsigned int i;
+	bool pass = true;
+	u8 *p;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		p = malloc(sizes[i]);
+		if (!p || !aligned(p, sizeof(long))) {
+			pass = false;
+			continue;
+		}
+		memset(p, 0xaa, sizes[i]);
+		free(p);
+	}
+	report("malloc", pass);
+}
+
+static bool seen(void **objs, void *p)
+{
+	int i;
+
+	for (i = 0; i < NR_OBJS; ++i)
+		if (objs[i] == p)
+			return true;
+	return false;
+}
+
+static void test_reuse(void)
+{
+	void *first[NR_OBJS], *objs[NR_OBJS], *p;
+	int i, round;
+	bool pass = true;
+
+	for (i = 0; i < NR_OBJS; ++i)
+		first[i] = malloc(128);
+	for (i = 0; i < NR_OBJS; ++i)
+		free(first[i]);
+
+	/* every round must get back the objects freed by the first one */
+	for (round = 0; round < 100; ++round) {
+		for (i = 0; i < NR_OBJS; ++i) {
+			objs[i] = malloc(128);
+			if (!objs[i] || !seen(first, objs[i]))
+				pass = false;
+		}
+		for (i = 0; i < NR_OBJS; ++i)
+			free(objs[i]);
+	}
+	report("malloc/free reuse", pass);
+
+	p = malloc(3 * PAGE_SIZE);
+	free(p);
+	report("large malloc/free reuse", p && malloc(3 * PAGE_SIZE) == p);
+}
+
+static void test_calloc(void)
+{
+	u8 *p;
+	int i;
+	bool pass;
+
+	p = malloc(256);
+	memset(p, 0xff, 256);
+	free(p);
+
+	p = calloc(16, 16);
+	pass = p != NULL;
+	for (i = 0; pass && i < 256; ++i)
+		pass = !p[i];
+	free(p);
+	report("calloc", pass);
+}
+
+static void test_memalign(void)
+{
+	unsigned long align;
+	void *p;
+	bool pass = true;
+
+	for (align = 16; align <= 4 * PAGE_SIZE; align <<= 1) {
+		p = memalign(align, 64);
+		if (!p || !aligned(p, align))
+			pass = false;
+		free(p);
+	}
+	report("memalign", pass);
+}
+
+int main(void)
+{
+	setup_vm();
+
+	test_sizes();
+	test_reuse();
+	test_calloc();
+	test_memalign();
+
+	return report_summary();
+}
@@ -0,0 +1,338 @@
+/*
+ * memset, memcpy, memcmp, strlen and strstr against byte-at-a-time
+ * references, for every alignment within a word and every length up to
+ * two words, and for buffers that end right before (or start right
+ * after) an unmapped page.  A read past such a buffer faults, which
+ * fails the test.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include "libcflat.h"
+#include "vm.h"
+
+#define WORD_SIZE	sizeof(long)
+#define MAX_LEN		(2 * WORD_SIZE)
+/* slack before and after the bytes under test, which must not change */
+#define GUARD		WORD_SIZE
+#define BUF_SIZE	(GUARD + WORD_SIZE + MAX_LEN + GUARD)
+
+static u8 buf1[BUF_SIZE] __attribute__((aligned(16)));
+static u8 buf2[BUF_SIZE] __attribute__((aligned(16)));
+static u8 expect[BUF_SIZE] __attribute__((aligned(16)));
+
+/*
+ * The references; the Makefile keeps gcc from turning their loops back
+ * into calls to the functions under test.
+ */
+static void ref_memset(u8 *s, u8 c, unsigned n)
+{
+	while (n--)
+		*s++ = c;
+}
+
+static void ref_memcpy(u8 *d, const u8 *s, unsigned n)
+{
+	while (n--)
+		*d++ = *s++;
+}
+
+static int ref_memcmp(const u8 *a, const u8 *b, unsigned n)
+{
+	for (; n; --n, ++a, ++b)
+		if (*a != *b)
+			return *a - *b;
+	return 0;
+}
+
+static unsigned ref_strlen(const char *s)
+{
+	unsigned n = 0;
+
+	while (s[n])
+		++n;
+	return n;
+}
+
+static const char *ref_strstr(const char *h, const char *n)
+{
+	unsigned i;
+
+	for (; ; ++h) {
+		for (i = 0; n[i] && h[i] == n[i]; ++i)
+			;
+		if (!n[i])
+			return h;
+		if (!*h)
+			return NULL;
+	}
+}
+
+static int sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+/* Nonzero bytes, with the high bit set in about half of them.  */
+static void fill(u8 *buf, unsigned n, unsigned seed)
+{
+	unsigned i;
+
+	for (i = 0; i < n; ++i)
+		buf[i] = 1 + (seed + i) * 13 % 0xff;
+}
+
+/* 'a's and 'b's, so that needles match partially and at many places.  */
+static void fill_ab(char *s, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; ++i)
+		s[i] = (0xb4d1 >> (i % 16)) & 1 ? 'b' : 'a';
+}
+
+/* The 15 strings of length 0 to 3 over 'a' and 'b', by index.  */
+static void make_needle(char *needle, unsigned k)
+{
+	unsigned len = 0, i;
+
+	while (k >= (1u << len))
+		k -= 1u << len++;
+	for (i = 0; i < len; ++i)
+		needle[i] = (k >> i) & 1 ? 'b' : 'a';
+	needle[len] = 0;
+}
+
+#define NR_NEEDLES	15
+
+/* A mapped page with unmapped pages on either side.  */
+static u8 *alloc_guarded_page(void)
+{
+	u8 *p = (u8 *)alloc_vpages(3) + PAGE_SIZE;
+
+	install_page(phys_to_virt(read_cr3()), virt_to_phys(alloc_page()), p);
+	return p;
+}
+
+static void test_memset(void)
+{
+	static const u8 vals[] = { 0, 0x5a, 0xc5 };
+	unsigned a, n, v;
+	bool pass = true;
+	u8 *p;
+
+	for (v = 0; v < ARRAY_SIZE(vals); ++v)
+		for (a = 0; a < WORD_SIZE; ++a)
+			for (n = 0; n <= MAX_LEN; ++n) {
+				fill(buf1, BUF_SIZE, 0);
+				fill(expect, BUF_SIZE, 0);
+				p = buf1 + GUARD + a;
+				ref_memset(expect + GUARD + a, vals[v], n);
+				if (memset(p, vals[v], n) != p ||
+				    ref_memcmp(buf1, expect, BUF_SIZE)) {
+					printf("memset: c=%#x align=%u len=%u\n",
+					       vals[v], a, n);
+					pass = false;
+				}
+			}
+	report("memset", pass);
+}
+
+static void test_memcpy(void)
+{
+	unsigned da, sa, n;
+	bool pass = true;
+	u8 *d, *s;
+
+	for (da = 0; da < WORD_SIZE; ++da)
+		for (sa = 0; sa < WORD_SIZE; ++sa)
+			for (n = 0; n <= MAX_LEN; ++n) {
+				fill(buf1, BUF_SIZE, 0);
+				fill(buf2, BUF_SIZE, 100);
+				fill(expect, BUF_SIZE, 100);
+				d = buf2 + GUARD + da;
+				s = buf1 + GUARD + sa;
+				ref_memcpy(expect + GUARD + da, s, n);
+				if (memcpy(d, s, n) != d ||
+				    ref_memcmp(buf2, expect, BUF_SIZE)) {
+					printf("memcpy: dst align=%u src align=%u len=%u\n",
+					       da, sa, n);
+					pass = false;
+				}
+			}
+	report("memcpy", pass);
+}
+
+/*
+ * memcmp of @x and @y once their first @n bytes are made equal, and then
+ * with each of those bytes in turn moved to the other side of 0x80 and
+ * everything after it garbled.
+ */
+static bool check_memcmp(u8 *x, u8 *y, unsigned n)
+{
+	unsigned d, i;
+	bool pass = true;
+
+	ref_memcpy(y, x, n);
+	if (memcmp(x, y, n))
+		pass = false;
+	for (d = 0; d < n; ++d) {
+		y[d] ^= 0x80;
+		for (i = d + 1; i < n; ++i)
+			y[i] = ~x[i];
+		if (sign(memcmp(x, y, n)) != sign(ref_memcmp(x, y, n)) ||
+		    sign(memcmp(y, x, n)) != sign(ref_memcmp(y, x, n)))
+			pass = false;
+		ref_memcpy(y, x, n);
+	}
+	return pass;
+}
+
+static void test_memcmp(void)
+{
+	unsigned a, b, n;
+	bool pass = true;
+	u8 *x, *y;
+
+	for (a = 0; a < WORD_SIZE; ++a)
+		for (b = 0; b < WORD_SIZE; ++b)
+			for (n = 0; n <= MAX_LEN; ++n) {
+				fill(buf1, BUF_SIZE, 0);
+				fill(buf2, BUF_SIZE, 100);
+				x = buf1 + GUARD + a;
+				y = buf2 + GUARD + b;
+				if (!check_memcmp(x, y, n)) {
+					printf("memcmp: align=%u,%u len=%u\n",
+					       a, b, n);
+					pass = false;
+				}
+			}
+	report("memcmp", pass);
+}
+
+static void test_strlen(void)
+{
+	unsigned a, n;
+	bool pass = true;
+	char *s;
+
+	for (a = 0; a < WORD_SIZE; ++a)
+		for (n = 0; n <= MAX_LEN; ++n) {
+			/* nonzero bytes on both sides of the terminator */
+			fill(buf1, BUF_SIZE, 0);
+			s = (char *)buf1 + GUARD + a;
+			s[n] = 0;
+			if (strlen(s) != n || ref_strlen(s) != n) {
+				printf("strlen: align=%u len=%u\n", a, n);
+				pass = false;
+			}
+		}
+	report("strlen", pass);
+}
+
+static bool check_strstr(const char *s)
+{
+	char needle[4];
+	unsigned k;
+	bool pass = true;
+
+	for (k = 0; k < NR_NEEDLES; ++k) {
+		make_needle(needle, k);
+		if (strstr(s, needle) != ref_strstr(s, needle))
+			pass = false;
+	}
+	return pass;
+}
+
+static void test_strstr(void)
+{
+	unsigned a, n;
+	bool pass = true;
+	char *s;
+
+	for (a = 0; a < WORD_SIZE; ++a)
+		for (n = 0; n <= MAX_LEN; ++n) {
+			/* more 'a's and 'b's after the terminator */
+			fill_ab((char *)buf1, BUF_SIZE);
+			s = (char *)buf1 + GUARD + a;
+			s[n] = 0;
+			if (!check_strstr(s)) {
+				printf("strstr: align=%u len=%u\n", a, n);
+				pass = false;
+			}
+		}
+	report("strstr", pass);
+}
+
+static void test_page_boundary(void)
+{
+	u8 *p1 = alloc_guarded_page(), *p2 = alloc_guarded_page();
+	u8 *end1 = p1 + PAGE_SIZE, *end2 = p2 + PAGE_SIZE;
+	bool pass = true;
+	unsigned n, i;
+	char *s;
+
+	for (n = 0; n <= MAX_LEN; ++n) {
+		memset(end1 - n, 0xc5, n);
+		memset(p2, 0xc5, n);
+		for (i = 0; i < n; ++i)
+			if ((end1 - n)[i] != 0xc5 || p2[i] != 0xc5)
+				pass = false;
+	}
+	report("memset at page boundary", pass);
+
+	pass = true;
+	for (n = 0; n <= MAX_LEN; ++n) {
+		fill(end1 - n, n, n);
+		memcpy(end2 - n, end1 - n, n);
+		if (ref_memcmp(end2 - n, end1 - n, n))
+			pass = false;
+		memcpy(p2, end1 - n, n);
+		if (ref_memcmp(p2, end1 - n, n))
+			pass = false;
+	}
+	report("memcpy at page boundary", pass);
+
+	pass = true;
+	for (n = 0; n <= MAX_LEN; ++n) {
+		fill(end1 - n, n, n);
+		if (!check_memcmp(end1 - n, end2 - n, n) ||
+		    !check_memcmp(end1 - n, p2, n))
+			pass = false;
+	}
+	report("memcmp at page boundary", pass);
+
+	pass = true;
+	for (n = 0; n <= MAX_LEN; ++n) {
+		/* the terminator is the last byte of the page */
+		s = (char *)end1 - n - 1;
+		fill((u8 *)s, n, 0);
+		s[n] = 0;
+		if (strlen(s) != n)
+			pass = false;
+	}
+	report("strlen at page boundary", pass);
+
+	pass = true;
+	for (n = 0; n <= MAX_LEN; ++n) {
+		s = (char *)end1 - n - 1;
+		fill_ab(s, n);
+		s[n] = 0;
+		if (!check_strstr(s))
+			pass = false;
+	}
+	report("strstr at page boundary", pass);
+}
+
+int main(void)
+{
+	setup_vm();
+
+	test_memset();
+	test_memcpy();
+	test_memcmp();
+	test_strlen();
+	test_strstr();
+	test_page_boundary();
+
+	return report_summary();
+}
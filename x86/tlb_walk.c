@@ -0,0 +1,321 @@
+/*
+ * Page-table walk benchmark: a randomized pointer chase over a working set
+ * mapped with 4K, 2M or 1G guest pages, touching one cache line per 4K
+ * page so that nearly every access needs a fresh translation.
+ *
+ * Usage: tlb_walk.flat [ws_mb=N] [accesses=N] [idmap=4k|2m|1g] [4k] [2m] [1g]
+ *
+ * Without page size arguments all sizes the CPU supports are measured.
+ * idmap= limits the pages of the identity map, where the code, stack and
+ * chase permutation live, so that they compete with the working set for
+ * TLB entries as they would in a guest without large pages.
+ * Each size prints one line with the average cost of an access and, when
+ * a vPMU is available, the number of completed page walks per access.
+ * Run it once per host backing (4K, THP, hugetlbfs) to see how guest and
+ * EPT/NPT page sizes combine.
+ */
+#include "libcflat.h"
+#include "alloc.h"
+#include "processor.h"
+#include "desc.h"
+#include "msr.h"
+#include "util.h"
+#include "x86/vm.h"
+#include "x86/acpi.h"
+
+/* each page size gets its own 512G slot, well above the identity map */
+#define MAP_BASE(i)	((unsigned long)((i) + 1) << 39)
+
+#define EVNTSEL_USR	(1 << 16)
+#define EVNTSEL_OS	(1 << 17)
+#define EVNTSEL_EN	(1 << 22)
+
+struct page_size {
+	const char *name;
+	unsigned long size;
+	bool selected;
+};
+
+static struct page_size page_sizes[] = {
+	{ "4k", PAGE_SIZE },
+	{ "2m", LARGE_PAGE_SIZE },
+	{ "1g", HUGE_PAGE_SIZE },
+};
+
+#define NR_PAGE_SIZES	(sizeof(page_sizes) / sizeof(page_sizes[0]))
+
+struct tlb_event {
+	const char *name;
+	u32 intel, amd;
+};
+
+/*
+ * Intel: DTLB_LOAD_MISSES.WALK_COMPLETED and .WALK_PENDING (Haswell and
+ * later).  AMD: PMCx045 with the L2 DTLB miss and hit unit masks.
+ */
+static struct tlb_event tlb_events[] = {
+	{ "walks", 0x0e08, 0xf045 },
+	{ "walk_cycles", 0x1008, 0 },
+	{ "stlb_hits", 0, 0x0f45 },
+};
+
+#define NR_TLB_EVENTS	(sizeof(tlb_events) / sizeof(tlb_events[0]))
+
+static enum { PMU_NONE, PMU_INTEL, PMU_AMD } pmu;
+static int pmu_version;
+static u64 tsc_hz;
+static unsigned long ws_size = 256ul << 20;
+static unsigned long accesses;
+static void * volatile chase_end;
+
+static u32 evntsel_msr(int i)
+{
+	return pmu == PMU_INTEL ? MSR_P6_EVNTSEL0 + i : MSR_K7_EVNTSEL0 + i;
+}
+
+static u32 perfctr_msr(int i)
+{
+	return pmu == PMU_INTEL ? MSR_IA32_PERFCTR0 + i : MSR_K7_PERFCTR0 + i;
+}
+
+static u32 event_sel(struct tlb_event *e)
+{
+	return pmu == PMU_INTEL ? e->intel : e->amd;
+}
+
+static void probe_wrmsr(void *data)
+{
+	wrmsr(evntsel_msr(0), 0);
+}
+
+static void pmu_init(void)
+{
+	struct cpuid id = cpuid(0);
+
+	if (id.b == 0x756e6547) {		/* "Genu"ineIntel */
+		id = cpuid(0xa);
+		pmu_version = id.a & 0xff;
+		if (pmu_version && ((id.a >> 8) & 0xff) >= NR_TLB_EVENTS)
+			pmu = PMU_INTEL;
+	} else if (id.b == 0x68747541) {	/* "Auth"enticAMD */
+		pmu = PMU_AMD;
+	}
+
+	if (pmu != PMU_NONE && test_for_exception(GP_VECTOR, probe_wrmsr, NULL))
+		pmu = PMU_NONE;
+}
+
+static void pmu_start(void)
+{
+	int i;
+
+	if (pmu == PMU_NONE)
+		return;
+
+	for (i = 0; i < NR_TLB_EVENTS; ++i) {
+		wrmsr(perfctr_msr(i), 0);
+		if (event_sel(&tlb_events[i]))
+			wrmsr(evntsel_msr(i), event_sel(&tlb_events[i]) |
+			      EVNTSEL_USR | EVNTSEL_OS | EVNTSEL_EN);
+	}
+	if (pmu == PMU_INTEL && pmu_version >= 2)
+		wrmsr(MSR_CORE_PERF_GLOBAL_CTRL, (1ull << NR_TLB_EVENTS) - 1);
+}
+
+static void pmu_stop(u64 *counts)
+{
+	int i;
+
+	if (pmu == PMU_NONE)
+		return;
+
+	if (pmu == PMU_INTEL && pmu_version >= 2)
+		wrmsr(MSR_CORE_PERF_GLOBAL_CTRL, 0);
+	for (i = 0; i < NR_TLB_EVENTS; ++i) {
+		wrmsr(evntsel_msr(i), 0);
+		counts[i] = rdmsr(perfctr_msr(i));
+	}
+}
+
+static u64 rand_state = 0x2545f4914f6cdd1dull;
+
+static u64 xorshift64(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+/*
+ * Link one node per 4K page of [base, base + size) into a single random
+ * cycle (Sattolo's algorithm).  Nodes sit at different line offsets so
+ * the chase does not hammer a single cache set.
+ */
+static void *build_chain(void *base, unsigned long size, u32 *perm)
+{
+	unsigned long n = size / PAGE_SIZE, i, j;
+	u32 tmp;
+
+#define NODE(k)	((void **)(base + (unsigned long)(k) * PAGE_SIZE + \
+			   ((k) % (PAGE_SIZE / 64)) * 64))
+
+	for (i = 0; i < n; ++i)
+		perm[i] = i;
+	for (i = n - 1; i > 0; --i) {
+		j = xorshift64() % i;
+		tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+	for (i = 0; i < n; ++i)
+		*NODE(perm[i]) = NODE(perm[(i + 1) % n]);
+
+	return NODE(perm[0]);
+#undef NODE
+}
+
+static void *chase(void *p, unsigned long count)
+{
+	while (count--)
+		p = *(void **)p;
+	return p;
+}
+
+static void map_range(unsigned long phys, void *virt, unsigned long size,
+		      unsigned long page)
+{
+	unsigned long *cr3 = phys_to_virt(read_cr3());
+	unsigned long off;
+
+	for (off = 0; off < size; off += page) {
+		if (page == HUGE_PAGE_SIZE)
+			install_huge_page(cr3, phys + off, virt + off);
+		else if (page == LARGE_PAGE_SIZE)
+			install_large_page(cr3, phys + off, virt + off);
+		else
+			install_page(cr3, phys + off, virt + off);
+	}
+}
+
+static void run(struct page_size *ps, void *virt, u32 *perm)
+{
+	u64 counts[NR_TLB_EVENTS], t0, t1, ps_per_access;
+	void *p;
+	int i;
+
+	p = build_chain(virt, ws_size, perm);
+	p = chase(p, ws_size / PAGE_SIZE);	/* warm up */
+
+	pmu_start();
+	t0 = rdtsc();
+	p = chase(p, accesses);
+	t1 = rdtsc();
+	pmu_stop(counts);
+
+	/* picoseconds, computed so that nothing overflows 64 bits */
+	ps_per_access = (t1 - t0) * 1000 / accesses * 1000000 /
+			(tsc_hz / 1000);
+
+	printf("tlb_walk page=%s ws_mb=%lu accesses=%lu "
+	       "cycles_per_access=%" PRIu64 " ns_per_access=%" PRIu64 ".%02"
+	       PRIu64, ps->name, ws_size >> 20, accesses,
+	       (t1 - t0) / accesses, ps_per_access / 1000,
+	       ps_per_access % 1000 / 10);
+	for (i = 0; pmu != PMU_NONE && i < NR_TLB_EVENTS; ++i) {
+		if (!event_sel(&tlb_events[i]))
+			continue;
+		printf(" %s_per_1k=%" PRIu64, tlb_events[i].name,
+		       counts[i] * 1000 / accesses);
+	}
+	printf("\n");
+	chase_end = p;
+}
+
+int main(int ac, char **av)
+{
+	unsigned long chunk = 0, idmap = 0, off;
+	bool any = false;
+	int i, j, order;
+	u32 *perm;
+	void *mem;
+	long val;
+
+	for (i = 1; i < ac; ++i) {
+		if (!strncmp(av[i], "idmap=", 6)) {
+			for (j = 0; j < NR_PAGE_SIZES; ++j)
+				if (!strcmp(av[i] + 6, page_sizes[j].name))
+					idmap = page_sizes[j].size;
+			continue;
+		}
+		if (parse_keyval(av[i], &val) >= 0) {
+			if (!strncmp(av[i], "ws_mb=", 6))
+				ws_size = (unsigned long)val << 20;
+			else if (!strncmp(av[i], "accesses=", 9))
+				accesses = val;
+			continue;
+		}
+		for (j = 0; j < NR_PAGE_SIZES; ++j)
+			if (!strcmp(av[i], page_sizes[j].name))
+				page_sizes[j].selected = any = true;
+	}
+	for (j = 0; !any && j < NR_PAGE_SIZES; ++j)
+		page_sizes[j].selected = true;
+	if (!(cpuid(0x80000001).d & (1 << 26))) {	/* PDPE1GB */
+		page_sizes[NR_PAGE_SIZES - 1].selected = false;
+		if (idmap == HUGE_PAGE_SIZE)
+			idmap = LARGE_PAGE_SIZE;
+	}
+
+	setup_idt();
+	if (idmap)
+		vm_set_max_page_size(idmap);
+	setup_vm();
+	tsc_hz = calibrate_tsc();
+	pmu_init();
+
+	ws_size = ALIGN(ws_size, PAGE_SIZE);
+	if (!accesses)
+		accesses = 4 * (ws_size / PAGE_SIZE);
+	if (accesses < 1000000)
+		accesses = 1000000;
+
+	/* back the working set with blocks of the largest page size used */
+	for (j = 0; j < NR_PAGE_SIZES; ++j)
+		if (page_sizes[j].selected)
+			chunk = page_sizes[j].size;
+	if (chunk < LARGE_PAGE_SIZE)
+		chunk = LARGE_PAGE_SIZE;
+	for (order = 0; (PAGE_SIZE << order) < chunk; ++order)
+		;
+
+	for (off = 0; off < ws_size; off += chunk) {
+		mem = alloc_pages(order);
+		if (!mem) {
+			report_skip("cannot allocate %lu MB in %lu MB blocks",
+				    ws_size >> 20, chunk >> 20);
+			return report_summary();
+		}
+		for (j = 0; j < NR_PAGE_SIZES; ++j)
+			if (page_sizes[j].selected)
+				map_range(virt_to_phys(mem),
+					  (void *)MAP_BASE(j) + off,
+					  chunk, page_sizes[j].size);
+	}
+
+	/* after the working set, so that the heap can't split its blocks */
+	perm = malloc(ws_size / PAGE_SIZE * sizeof(*perm));
+	if (!perm) {
+		report_skip("no memory for a %lu MB working set", ws_size >> 20);
+		return report_summary();
+	}
+
+	printf("tsc frequency %" PRIu64 " Hz, pmu %s\n", tsc_hz,
+	       pmu == PMU_INTEL ? "intel" : pmu == PMU_AMD ? "amd" : "none");
+
+	for (j = 0; j < NR_PAGE_SIZES; ++j)
+		if (page_sizes[j].selected)
+			run(&page_sizes[j], (void *)MAP_BASE(j), perm);
+
+	return report_summary();
+}
@@ -1,12 +1,13 @@
 /*
- * qemu command line | grep latency | cut -f 2 -d ":" > latency
+ * TSC deadline timer latency, measured on every CPU at once.
  *
- * In octave:
- * load latency
- * min(latency)
- * max(latency)
- * mean(latency)
- * hist(latency, 50)
+ * Usage: tscdeadline_latency.flat [delta [samples [breakmax]]]
+ *
+ * Each CPU re-arms its timer delta cycles after every interrupt and
+ * records how late the interrupt arrived in a histogram from lib/hist.h,
+ * so runs are not limited by the number of samples.  At the end, one
+ * line per CPU and one for all of them give min/percentiles/max/mean in
+ * TSC cycles.
  */
 
 /*
@@ -27,6 +28,9 @@
 #include "desc.h"
 #include "isr.h"
 #include "msr.h"
+#include "atomic.h"
+#include "console.h"
+#include "hist.h"
 
 static void test_lapic_existence(void)
 {
@@ -39,60 +43,73 @@ static void test_lapic_existence(void)
 
 #define TSC_DEADLINE_TIMER_VECTOR 0xef
 
-static int tdt_count;
-u64 exptime;
-int delta;
-#define TABLE_SIZE 10000
-u64 table[TABLE_SIZE];
-volatile int table_idx;
-volatile int hitmax = 0;
-int breakmax = 0;
+struct tdt_cpu {
+    int tdt_count;
+    u64 exptime;
+    struct hist hist;
+} __attribute__((aligned(64)));
+
+static struct tdt_cpu tdt_cpus[NR_CPUS];
+static int ncpus;
+static int delta;
+static u64 samples;
+static volatile int hitmax = 0;
+static volatile int hitmax_cpu;
+static u64 breakmax = 0;
+static atomic_t nr_done;
 
 static void tsc_deadline_timer_isr(isr_regs_t *regs)
 {
+    struct tdt_cpu *c = &tdt_cpus[smp_id()];
     u64 now = rdtsc();
-    ++tdt_count;
 
-    if (table_idx < TABLE_SIZE && tdt_count > 1)
-        table[table_idx++] = now - exptime;
+    ++c->tdt_count;
+
+    if (c->tdt_count > 1)
+        hist_add(&c->hist, now - c->exptime);
 
-    if (breakmax && tdt_count > 1 && (now - exptime) > breakmax) {
+    if (breakmax && c->tdt_count > 1 && (now - c->exptime) > breakmax) {
+        hitmax_cpu = smp_id();
         hitmax = 1;
         apic_write(APIC_EOI, 0);
         return;
     }
 
-    exptime = now+delta;
-    wrmsr(MSR_IA32_TSCDEADLINE, now+delta);
+    if (c->hist.nr < samples && !hitmax) {
+        c->exptime = now + delta;
+        wrmsr(MSR_IA32_TSCDEADLINE, now + delta);
+    }
     apic_write(APIC_EOI, 0);
 }
 
 static void start_tsc_deadline_timer(void)
 {
-    handle_irq(TSC_DEADLINE_TIMER_VECTOR, tsc_deadline_timer_isr);
+    struct tdt_cpu *c = &tdt_cpus[smp_id()];
+
     irq_enable();
 
-    wrmsr(MSR_IA32_TSCDEADLINE, rdmsr(MSR_IA32_TSC)+delta);
+    c->exptime = rdmsr(MSR_IA32_TSC) + delta;
+    wrmsr(MSR_IA32_TSCDEADLINE, c->exptime);
     asm volatile ("nop");
 }
 
-static int enable_tsc_deadline_timer(void)
+static bool has_tsc_deadline_timer(void)
+{
+    return cpuid(1).c & (1 << 24);
+}
+
+static void enable_tsc_deadline_timer(void)
 {
     uint32_t lvtt;
 
-    if (cpuid(1).c & (1 << 24)) {
-        lvtt = APIC_LVT_TIMER_TSCDEADLINE | TSC_DEADLINE_TIMER_VECTOR;
-        apic_write(APIC_LVTT, lvtt);
-        start_tsc_deadline_timer();
-        return 1;
-    } else {
-        return 0;
-    }
+    lvtt = APIC_LVT_TIMER_TSCDEADLINE | TSC_DEADLINE_TIMER_VECTOR;
+    apic_write(APIC_LVTT, lvtt);
+    start_tsc_deadline_timer();
 }
 
 static void test_tsc_deadline_timer(void)
 {
-    if(enable_tsc_deadline_timer()) {
+    if (has_tsc_deadline_timer()) {
         printf("tsc deadline timer enabled\n");
     } else {
         printf("tsc deadline timer not detected, aborting\n");
@@ -100,9 +117,26 @@ static void test_tsc_deadline_timer(void)
     }
 }
 
+/* Runs on every CPU until it has its samples or some CPU hit breakmax.  */
+static void measure(void *data)
+{
+    struct tdt_cpu *c = &tdt_cpus[smp_id()];
+
+    enable_tsc_deadline_timer();
+    do {
+        asm volatile("hlt");
+    } while (!hitmax && c->hist.nr < samples);
+
+    wrmsr(MSR_IA32_TSCDEADLINE, 0);
+    irq_disable();
+    atomic_inc(&nr_done);
+}
+
 int main(int argc, char **argv)
 {
-    int i, size;
+    static struct hist all;
+    char who[24];
+    int i;
 
     setup_vm();
     smp_init();
@@ -111,22 +145,32 @@ int main(int argc, char **argv)
 
     mask_pic_interrupts();
 
+    ncpus = cpu_count();
+
     delta = argc <= 1 ? 200000 : atol(argv[1]);
-    size = argc <= 2 ? TABLE_SIZE : atol(argv[2]);
+    samples = argc <= 2 ? 10000 : atol(argv[2]);
     breakmax = argc <= 3 ? 0 : atol(argv[3]);
-    printf("breakmax=%d\n", breakmax);
+    printf("breakmax=%" PRIu64 "\n", breakmax);
+    handle_irq(TSC_DEADLINE_TIMER_VECTOR, tsc_deadline_timer_isr);
     test_tsc_deadline_timer();
-    irq_enable();
-
-    do {
-        asm volatile("hlt");
-    } while (!hitmax && table_idx < size);
 
-    for (i = 0; i < table_idx; i++) {
-        if (hitmax && i == table_idx-1)
-            printf("hit max: %d < ", breakmax);
-        printf("latency: %" PRId64 "\n", table[i]);
+    for (i = 1; i < ncpus; i++)
+        on_cpu_async(i, measure, NULL);
+    measure(NULL);
+    while (atomic_read(&nr_done) < ncpus)
+        pause();
+
+    /* one line per CPU: write them out in a few large chunks */
+    console_set_buffered(true);
+    if (hitmax)
+        printf("hit max: cpu %d > %" PRIu64 "\n", hitmax_cpu, breakmax);
+
+    for (i = 0; i < ncpus; i++) {
+        snprintf(who, sizeof(who), "latency cpu%d:", i);
+        hist_print(who, &tdt_cpus[i].hist);
+        hist_merge(&all, &tdt_cpus[i].hist);
     }
+    hist_print("latency all:", &all);
 
     return report_summary();
 }
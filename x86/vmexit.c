@@ -6,6 +6,9 @@
 #include "x86/vm.h"
 #include "x86/desc.h"
 #include "x86/acpi.h"
+#include "x86/console.h"
+#include "bench.h"
+#include "hist.h"
 
 struct test {
 	void (*func)(void);
@@ -18,6 +21,9 @@ struct test {
 #define GOAL (1ull << 30)
 
 static int nr_cpus;
+static bool stats_mode;
+static bool scaling_mode;
+static bool bench_mode;
 
 static void cpuid_test(void)
 {
@@ -293,17 +299,173 @@ static struct test tests[] = {
 unsigned iterations;
 static atomic_t nr_cpus_done;
 
+/* Latency histograms for the "stats" mode.  */
+static struct hist cpu_hist[NR_CPUS];
+static struct hist total_hist;
+static unsigned warmup;
+static u64 tsc_overhead;
+
+static inline u64 rdtsc_ordered(void)
+{
+	asm volatile ("lfence" : : : "memory");
+	return rdtsc();
+}
+
+/* Cost of an empty rdtsc_ordered() pair, subtracted from every sample.  */
+static void measure_tsc_overhead(void)
+{
+	u64 t1, t2;
+	int i;
+
+	tsc_overhead = -1ull;
+	for (i = 0; i < 1000; ++i) {
+		t1 = rdtsc_ordered();
+		t2 = rdtsc_ordered();
+		if (t2 - t1 < tsc_overhead)
+			tsc_overhead = t2 - t1;
+	}
+}
+
+static u64 cpu_start[NR_CPUS], cpu_end[NR_CPUS];
+
 static void run_test(void *_func)
 {
     int i;
     void (*func)(void) = _func;
+    int cpu = smp_id();
 
+    cpu_start[cpu] = rdtsc();
     for (i = 0; i < iterations; ++i)
         func();
+    cpu_end[cpu] = rdtsc();
 
     atomic_inc(&nr_cpus_done);
 }
 
+static void run_test_stats(void *_func)
+{
+	void (*func)(void) = _func;
+	struct hist *h = &cpu_hist[smp_id()];
+	u64 t1, t2, delta;
+	int i;
+
+	hist_reset(h);
+	for (i = 0; i < warmup + iterations; ++i) {
+		t1 = rdtsc_ordered();
+		func();
+		t2 = rdtsc_ordered();
+		if (i < warmup)
+			continue;
+		delta = t2 - t1;
+		hist_add(h, delta > tsc_overhead ? delta - tsc_overhead : 0);
+	}
+
+	atomic_inc(&nr_cpus_done);
+}
+
+static void run_on_cpus(int ncpus, void (*runner)(void *), void (*func)(void))
+{
+	int i;
+
+	atomic_set(&nr_cpus_done, 0);
+	for (i = ncpus; i > 0; i--)
+		on_cpu_async(i-1, runner, func);
+	while (atomic_read(&nr_cpus_done) < ncpus)
+		;
+}
+
+static void run_parallel(void (*runner)(void *), void (*func)(void))
+{
+	run_on_cpus(cpu_count(), runner, func);
+}
+
+static u64 tsc_hz;
+
+/*
+ * Run a parallel test on 1, 2, ... cpu_count() CPUs with the iteration
+ * count found by do_test().  The per-CPU cost comes from the timestamps
+ * each CPU takes around its own loop in run_test(); throughput uses the
+ * span from the earliest start to the latest end.  Efficiency is the
+ * throughput relative to ncpus times the single-CPU throughput.
+ */
+static void do_test_scaling(struct test *test, void (*func)(void))
+{
+	u64 first, last, per_cpu, rate, rate1 = 0;
+	int ncpus, i;
+
+	for (ncpus = 1; ncpus <= cpu_count(); ncpus++) {
+		nr_cpus = ncpus;
+		run_on_cpus(ncpus, run_test, func);
+
+		first = -1ull;
+		last = per_cpu = 0;
+		for (i = 0; i < ncpus; ++i) {
+			if (cpu_start[i] < first)
+				first = cpu_start[i];
+			if (cpu_end[i] > last)
+				last = cpu_end[i];
+			per_cpu += (cpu_end[i] - cpu_start[i]) / iterations;
+		}
+		per_cpu /= ncpus;
+		/* scale both sides down to keep the product within 64 bits */
+		rate = (u64)ncpus * iterations * (tsc_hz / 1000)
+			/ ((last - first) / 1000);
+		if (ncpus == 1)
+			rate1 = rate;
+
+		printf("%s cpus=%d cycles=%" PRIu64 " exits_per_sec=%" PRIu64
+		       " efficiency=%" PRIu64 "\n", test->name, ncpus, per_cpu,
+		       rate, rate * 100 / (rate1 * ncpus));
+	}
+	nr_cpus = cpu_count();
+}
+
+/*
+ * Repeat the test with the iteration count found by do_test(), timing
+ * every call separately.  The first 1/8th of the calls are discarded as
+ * warm-up, the rest are merged across CPUs into one histogram.
+ */
+static void do_test_stats(struct test *test, void (*func)(void))
+{
+	int i;
+
+	warmup = iterations / 8;
+	if (!test->parallel) {
+		run_test_stats(func);
+	} else {
+		run_parallel(run_test_stats, func);
+	}
+
+	hist_reset(&total_hist);
+	for (i = 0; i < (test->parallel ? cpu_count() : 1); ++i)
+		hist_merge(&total_hist, &cpu_hist[test->parallel ? i : smp_id()]);
+	hist_print(test->name, &total_hist);
+}
+
+static void bench_call(void *func)
+{
+	((void (*)(void))func)();
+}
+
+/*
+ * Time the test with lib/bench.c and print BENCH: lines, one per CPU for
+ * parallel tests, which run on every CPU at the same time.
+ */
+static void do_test_bench(struct test *test, void (*func)(void))
+{
+	static struct bench_result results[NR_CPUS];
+	struct bench b = { test->name, bench_call, func };
+	int i;
+
+	if (!test->parallel) {
+		bench_one(&b);
+		return;
+	}
+	bench_run_cpus(&b, results, cpu_count());
+	for (i = 0; i < cpu_count(); ++i)
+		bench_print(&b, &results[i]);
+}
+
 static bool do_test(struct test *test)
 {
 	int i;
@@ -327,6 +489,11 @@ static bool do_test(struct test *test)
 		return false;
 	}
 
+	if (bench_mode) {
+		do_test_bench(test, func);
+		return test->next;
+	}
+
 	do {
 		iterations *= 2;
 		t1 = rdtsc();
@@ -335,15 +502,17 @@ static bool do_test(struct test *test)
 			for (i = 0; i < iterations; ++i)
 				func();
 		} else {
-			atomic_set(&nr_cpus_done, 0);
-			for (i = cpu_count(); i > 0; i--)
-				on_cpu_async(i-1, run_test, func);
-			while (atomic_read(&nr_cpus_done) < cpu_count())
-				;
+			run_parallel(run_test, func);
 		}
 		t2 = rdtsc();
 	} while ((t2 - t1) < GOAL);
-	printf("%s %d\n", test->name, (int)((t2 - t1) / iterations));
+
+	if (stats_mode)
+		do_test_stats(test, func);
+	else if (scaling_mode && test->parallel)
+		do_test_scaling(test, func);
+	else
+		printf("%s %d\n", test->name, (int)((t2 - t1) / iterations));
 	return test->next;
 }
 
@@ -402,6 +571,28 @@ int main(int ac, char **av)
 		       pcidev, membar, pci_test.iobar);
 	}
 
+	/*
+	 * "stats" as the first argument reports a latency distribution
+	 * per test instead of the average cost; "scaling" repeats every
+	 * parallel test on 1..N CPUs; "bench" prints BENCH: lines.
+	 */
+	if (ac > 1 && strcmp(av[1], "stats") == 0) {
+		stats_mode = true;
+		ac--, av++;
+		measure_tsc_overhead();
+		printf("stats: tsc overhead %" PRIu64 " cycles\n", tsc_overhead);
+	} else if (ac > 1 && strcmp(av[1], "scaling") == 0) {
+		scaling_mode = true;
+		ac--, av++;
+		tsc_hz = calibrate_tsc();
+		printf("scaling: tsc frequency %" PRIu64 " Hz\n", tsc_hz);
+	} else if (ac > 1 && strcmp(av[1], "bench") == 0) {
+		bench_mode = true;
+		ac--, av++;
+	}
+
+	/* keep the results in the buffer while the next tests run */
+	console_set_buffered(true);
 	for (i = 0; i < ARRAY_SIZE(tests); ++i)
 		if (test_wanted(&tests[i], av + 1, ac - 1))
 			while (do_test(&tests[i])) {}